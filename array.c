@@ -0,0 +1,184 @@
+#include "array.h"
+
+// The kernels are written once against a small vector interface: Vec holds
+// Vec_Width doubles, 4 with AVX (only when built with -mavx or a -march that
+// has it), 2 with SSE2 which every x86-64 has. the loop over whole vectors
+// is followed by a scalar loop for the rest, without either instruction set
+// the scalar loop does everything. loads and stores are unaligned, the
+// buffers come from x_alloc which only promises 16 bytes.
+//
+// sum, min and max keep Vec_Width partial results and combine them at the
+// end, so sums can differ from a left to right loop in the last bits.
+#if defined(__AVX__)
+  #include <immintrin.h>
+  typedef __m256d Vec;
+  #define Vec_Width              4
+  #define Vec_Load(ptr)          _mm256_loadu_pd(ptr)
+  #define Vec_Store(ptr, vec)    _mm256_storeu_pd(ptr, vec)
+  #define Vec_Splat(k)           _mm256_set1_pd(k)
+  #define Vec_Add(x, y)          _mm256_add_pd(x, y)
+  #define Vec_Mul(x, y)          _mm256_mul_pd(x, y)
+  #define Vec_Min(x, y)          _mm256_min_pd(x, y)
+  #define Vec_Max(x, y)          _mm256_max_pd(x, y)
+  #define Vec_Less_Mask(x, y)    _mm256_movemask_pd(_mm256_cmp_pd(x, y, _CMP_LT_OQ))
+  #define Vec_Greater_Mask(x, y) _mm256_movemask_pd(_mm256_cmp_pd(x, y, _CMP_GT_OQ))
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  typedef __m128d Vec;
+  #define Vec_Width              2
+  #define Vec_Load(ptr)          _mm_loadu_pd(ptr)
+  #define Vec_Store(ptr, vec)    _mm_storeu_pd(ptr, vec)
+  #define Vec_Splat(k)           _mm_set1_pd(k)
+  #define Vec_Add(x, y)          _mm_add_pd(x, y)
+  #define Vec_Mul(x, y)          _mm_mul_pd(x, y)
+  #define Vec_Min(x, y)          _mm_min_pd(x, y)
+  #define Vec_Max(x, y)          _mm_max_pd(x, y)
+  #define Vec_Less_Mask(x, y)    _mm_movemask_pd(_mm_cmplt_pd(x, y))
+  #define Vec_Greater_Mask(x, y) _mm_movemask_pd(_mm_cmpgt_pd(x, y))
+#else
+  #define Vec_Width 1
+#endif
+
+// elements before this are handled by the vector loop
+#define Vec_End(count) ((count) - (count) % Vec_Width)
+
+void array_add(double* dst, double* x, double* y, i32 count) {
+  i32 idx = 0;
+#if Vec_Width > 1
+  for(; idx < Vec_End(count); idx+=Vec_Width)
+    Vec_Store(dst + idx, Vec_Add(Vec_Load(x + idx), Vec_Load(y + idx)));
+#endif
+  for(; idx < count; idx+=1)
+    dst[idx] = x[idx] + y[idx];
+}
+
+void array_mul(double* dst, double* x, double* y, i32 count) {
+  i32 idx = 0;
+#if Vec_Width > 1
+  for(; idx < Vec_End(count); idx+=Vec_Width)
+    Vec_Store(dst + idx, Vec_Mul(Vec_Load(x + idx), Vec_Load(y + idx)));
+#endif
+  for(; idx < count; idx+=1)
+    dst[idx] = x[idx] * y[idx];
+}
+
+void array_add_scalar(double* dst, double* x, double k, i32 count) {
+  i32 idx = 0;
+#if Vec_Width > 1
+  Vec ks = Vec_Splat(k);
+  for(; idx < Vec_End(count); idx+=Vec_Width)
+    Vec_Store(dst + idx, Vec_Add(Vec_Load(x + idx), ks));
+#endif
+  for(; idx < count; idx+=1)
+    dst[idx] = x[idx] + k;
+}
+
+void array_mul_scalar(double* dst, double* x, double k, i32 count) {
+  i32 idx = 0;
+#if Vec_Width > 1
+  Vec ks = Vec_Splat(k);
+  for(; idx < Vec_End(count); idx+=Vec_Width)
+    Vec_Store(dst + idx, Vec_Mul(Vec_Load(x + idx), ks));
+#endif
+  for(; idx < count; idx+=1)
+    dst[idx] = x[idx] * k;
+}
+
+double array_sum(double* x, i32 count) {
+  i32 idx = 0;
+  double sum = 0;
+#if Vec_Width > 1
+  Vec sums = Vec_Splat(0);
+  for(; idx < Vec_End(count); idx+=Vec_Width)
+    sums = Vec_Add(sums, Vec_Load(x + idx));
+  double lanes[Vec_Width];
+  Vec_Store(lanes, sums);
+  for(i32 lane = 0; lane < Vec_Width; lane+=1)
+    sum += lanes[lane];
+#endif
+  for(; idx < count; idx+=1)
+    sum += x[idx];
+  return sum;
+}
+
+double array_min(double* x, i32 count) {
+  i32 idx = 1;
+  double min = x[0];
+#if Vec_Width > 1
+  if(count >= Vec_Width) {
+    Vec mins = Vec_Load(x);
+    for(idx = Vec_Width; idx < Vec_End(count); idx+=Vec_Width)
+      mins = Vec_Min(mins, Vec_Load(x + idx));
+    double lanes[Vec_Width];
+    Vec_Store(lanes, mins);
+    for(i32 lane = 0; lane < Vec_Width; lane+=1)
+      min = lanes[lane] < min ? lanes[lane] : min;
+  }
+#endif
+  for(; idx < count; idx+=1)
+    min = x[idx] < min ? x[idx] : min;
+  return min;
+}
+
+double array_max(double* x, i32 count) {
+  i32 idx = 1;
+  double max = x[0];
+#if Vec_Width > 1
+  if(count >= Vec_Width) {
+    Vec maxs = Vec_Load(x);
+    for(idx = Vec_Width; idx < Vec_End(count); idx+=Vec_Width)
+      maxs = Vec_Max(maxs, Vec_Load(x + idx));
+    double lanes[Vec_Width];
+    Vec_Store(lanes, maxs);
+    for(i32 lane = 0; lane < Vec_Width; lane+=1)
+      max = lanes[lane] > max ? lanes[lane] : max;
+  }
+#endif
+  for(; idx < count; idx+=1)
+    max = x[idx] > max ? x[idx] : max;
+  return max;
+}
+
+// the compare gives a bit per lane, only the lanes whose bit is set are
+// copied. a vector nothing passes costs a single test
+i32 array_filter_less(double* dst, double* x, double k, i32 count) {
+  i32 idx = 0, kept = 0;
+#if Vec_Width > 1
+  Vec ks = Vec_Splat(k);
+  for(; idx < Vec_End(count); idx+=Vec_Width) {
+    u32 mask = Vec_Less_Mask(Vec_Load(x + idx), ks);
+    for(; mask != 0; mask &= mask -1) {
+      dst[kept] = x[idx + __builtin_ctz(mask)];
+      kept += 1;
+    }
+  }
+#endif
+  for(; idx < count; idx+=1) {
+    if(x[idx] < k) {
+      dst[kept] = x[idx];
+      kept += 1;
+    }
+  }
+  return kept;
+}
+
+i32 array_filter_greater(double* dst, double* x, double k, i32 count) {
+  i32 idx = 0, kept = 0;
+#if Vec_Width > 1
+  Vec ks = Vec_Splat(k);
+  for(; idx < Vec_End(count); idx+=Vec_Width) {
+    u32 mask = Vec_Greater_Mask(Vec_Load(x + idx), ks);
+    for(; mask != 0; mask &= mask -1) {
+      dst[kept] = x[idx + __builtin_ctz(mask)];
+      kept += 1;
+    }
+  }
+#endif
+  for(; idx < count; idx+=1) {
+    if(x[idx] > k) {
+      dst[kept] = x[idx];
+      kept += 1;
+    }
+  }
+  return kept;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "common.h"
+
+// Element-wise kernels behind Object_Array, see array.c. dst may be one of
+// the operands. min and max need count > 0, NaN elements give an
+// unspecified result. the filters write the elements of x passing the
+// comparison to dst in order and return how many there were
+void array_add(double* dst, double* x, double* y, i32 count);
+void array_mul(double* dst, double* x, double* y, i32 count);
+void array_add_scalar(double* dst, double* x, double k, i32 count);
+void array_mul_scalar(double* dst, double* x, double k, i32 count);
+double array_sum(double* x, i32 count);
+double array_min(double* x, i32 count);
+double array_max(double* x, i32 count);
+i32 array_filter_less(double* dst, double* x, double k, i32 count);
+i32 array_filter_greater(double* dst, double* x, double k, i32 count);
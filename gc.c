@@ -0,0 +1,356 @@
+#include "gc.h"
+#include "machine.h"
+#include "table.h"
+
+// Generational mark and sweep collector.
+//
+// New objects are put on the nursery list. When the nursery is full a minor
+// collection marks the young objects reachable from the roots, promotes them
+// to the old generation (env->objects) and frees the rest. Old objects are
+// not traced by a minor collection, the old objects a young object was
+// stored into since the last minor collection are found through the
+// remembered set instead. nothing moves, promotion only relinks the object.
+//
+// Roots are the live part of the eval stack, the constant pool, global
+// values and global names. Locals live on the eval stack which every minor
+// collection scans, so Op_Set_Local needs no barrier. Global slots written
+// with a young object are listed by gc_remember_global() and only those are
+// scanned, constants and names are only scanned above what was promoted
+// already. interned_strings only holds weak references, a string nobody
+// else points to is dropped from it before the sweep.
+//
+// A major collection marks and sweeps the old generation. It runs once the
+// old generation outgrew next_gc, either in one go or, with a step_budget,
+// spread over the following allocations: each allocation marks or sweeps
+// step_budget objects. While marking, gc_write_barrier() grays an old object
+// stored into an already marked one, objects promoted meanwhile are marked
+// and traced, and marking finishes with an empty nursery and a rescan of the
+// roots. the sweep unlinks the old generation first so promotions during it
+// aren't swept.
+//
+// Marking is done with an explicit gray stack instead of recursion so deeply
+// nested lists can't overflow the C stack.
+
+void gc_allocate(Gc* gc) {
+  gc->nursery = NULL;
+  gc->sweeping = NULL;
+  gc->nursery_bytes = 0;
+  gc->nursery_size = Gc_Nursery_Size;
+  gc->bytes_allocated = 0;
+  gc->min_heap = Gc_Min_Heap;
+  gc->grow_factor = Gc_Grow_Factor;
+  gc->next_gc = gc->min_heap;
+  gc->step_budget = Gc_Step_Budget;
+  gc->phase = Gc_Idle;
+  gc->gray_stack = NULL;
+  gc->gray_count = gc->gray_cap = 0;
+  gc->remembered = NULL;
+  gc->remembered_count = gc->remembered_cap = 0;
+  gc->dirty_globals = NULL;
+  gc->dirty_count = gc->dirty_cap = 0;
+  byte_vector_allocate(&gc->global_cards);
+  gc->old_constants = 0;
+  gc->old_global_names = 0;
+}
+
+// objects themselves are freed by free_objects()
+void gc_deallocate(Env* env) {
+  Gc* gc = &env->gc;
+  FREE(gc->gray_stack);
+  FREE(gc->remembered);
+  FREE(gc->dirty_globals);
+  byte_vector_deallocate(&gc->global_cards);
+  gc->gray_count = gc->gray_cap = 0;
+  gc->remembered_count = gc->remembered_cap = 0;
+  gc->dirty_count = gc->dirty_cap = 0;
+}
+
+// rough footprint of an object and everything it owns, used for pacing
+size_t object_size(Object* object) {
+  switch(object->kind) {
+    case Ok_String: {
+      Object_String* str = (Object_String*)object;
+      return sizeof(Object_String) + (str->is_borrowed ? 0 : str->len +1);
+    }
+    case Ok_List:
+      return sizeof(Object_List) +
+        sizeof(value) * ((Object_List*)object)->vector.cap;
+    case Ok_Function:
+      return sizeof(Object_Function) + ((Object_Function*)object)->code.cap;
+    case Ok_Rope: {
+      Object_Rope* rope = (Object_Rope*)object;
+      return sizeof(Object_Rope) + (rope->str != NULL ? rope->len +1 : 0);
+    }
+    case Ok_Native:
+      return sizeof(Object_Native);
+    case Ok_Slice:
+      return sizeof(Object_Slice);
+    case Ok_Array:
+      return sizeof(Object_Array) +
+        sizeof(double) * ((Object_Array*)object)->vector.cap;
+    case Ok_Dict:
+      return sizeof(Object_Dict) +
+        (sizeof(Entry) +1) * ((Object_Dict*)object)->table.cap;
+  }
+  return 0;
+}
+
+// memory handed out on behalf of a new object, counts against the nursery
+void gc_account(Env* env, size_t bytes) {
+  env->gc.nursery_bytes += bytes;
+}
+
+static void gray_push(Gc* gc, Object* object) {
+  if(gc->gray_cap < gc->gray_count +1) {
+    gc->gray_cap = gc->gray_cap < 8 ? 8 : gc->gray_cap * 2;
+    gc->gray_stack = REALLOCATE(Object*, gc->gray_stack, gc->gray_cap);
+  }
+  gc->gray_stack[gc->gray_count] = object;
+  gc->gray_count += 1;
+}
+
+// minor collections only mark young objects, major ones only old objects
+static void mark_object(Env* env, Object* object, bool minor) {
+  if(object == NULL || object->is_marked) return;
+  if(minor != Object_isYoung(object)) return;
+  object->is_marked = true;
+  gray_push(&env->gc, object);
+}
+
+static void mark_value(Env* env, value val, bool minor) {
+  if(Value_isObject(val))
+    mark_object(env, Value_asObject(val), minor);
+}
+
+static void mark_values(Env* env, value* values, i32 count, bool minor) {
+  for(i32 x = 0; x < count; x+=1)
+    mark_value(env, values[x], minor);
+}
+
+static void blacken_object(Env* env, Object* object, bool minor) {
+  switch(object->kind) {
+    case Ok_String: break;
+    case Ok_List: {
+      Object_List* list = (Object_List*)object;
+      mark_values(env, list->vector.data, list->vector.count, minor);
+    } break;
+    case Ok_Function: {
+      Object_Function* fn = (Object_Function*)object;
+      mark_object(env, (Object*)fn->name, minor);
+    } break;
+    case Ok_Rope: {
+      Object_Rope* rope = (Object_Rope*)object;
+      mark_object(env, rope->left, minor);
+      mark_object(env, rope->right, minor);
+    } break;
+    case Ok_Native:
+      mark_object(env, (Object*)((Object_Native*)object)->name, minor);
+      break;
+    case Ok_Slice:
+      mark_object(env, (Object*)((Object_Slice*)object)->list, minor);
+      break;
+    case Ok_Array: break;
+    case Ok_Dict: {
+      Table* table = &((Object_Dict*)object)->table;
+      for(i32 x = table_next(table, 0); x != -1; x = table_next(table, x +1)) {
+        mark_value(env, table->entries[x].key, minor);
+        mark_value(env, table->entries[x].val, minor);
+      }
+    } break;
+  }
+}
+
+// blackens gray objects above base until there are none left or budget
+// objects were done (budget < 0 means no limit). true once nothing is left
+static bool trace_references(Env* env, i32 base, bool minor, i32 budget) {
+  Gc* gc = &env->gc;
+  for(i32 done = 0; gc->gray_count > base; done+=1) {
+    if(budget >= 0 && done >= budget) return false;
+    gc->gray_count -= 1;
+    blacken_object(env, gc->gray_stack[gc->gray_count], minor);
+  }
+  return true;
+}
+
+static void mark_roots(Env* env) {
+  mark_values(env, env->stack, env->stack_top - env->stack, false);
+  mark_values(env, env->constants.data, env->constants.count, false);
+  mark_values(env, env->global_values.data, env->global_values.count, false);
+  mark_values(env, env->global_names.data, env->global_names.count, false);
+}
+
+void gc_remember_global(Env* env, i32 slot) {
+  Gc* gc = &env->gc;
+  if(gc->global_cards.data[slot]) return;
+  gc->global_cards.data[slot] = 1;
+
+  if(gc->dirty_cap < gc->dirty_count +1) {
+    gc->dirty_cap = gc->dirty_cap < 8 ? 8 : gc->dirty_cap * 2;
+    gc->dirty_globals = REALLOCATE(i32, gc->dirty_globals, gc->dirty_cap);
+  }
+  gc->dirty_globals[gc->dirty_count] = slot;
+  gc->dirty_count += 1;
+}
+
+// the constant pool was cut back to count, the slots above get young values
+// again and minor collections have to scan them from there on
+void gc_drop_constants(Env* env, i32 count) {
+  if(env->gc.old_constants > count)
+    env->gc.old_constants = count;
+}
+
+// has to be called whenever val is stored into an existing object
+void gc_write_barrier(Env* env, Object* owner, value val) {
+  if(!Value_isObject(val)) return;
+  Gc* gc = &env->gc;
+  Object* object = Value_asObject(val);
+
+  if(!Object_isYoung(owner) && Object_isYoung(object) && !owner->is_remembered) {
+    if(gc->remembered_cap < gc->remembered_count +1) {
+      gc->remembered_cap = gc->remembered_cap < 8 ? 8 : gc->remembered_cap * 2;
+      gc->remembered = REALLOCATE(Object*, gc->remembered, gc->remembered_cap);
+    }
+    gc->remembered[gc->remembered_count] = owner;
+    gc->remembered_count += 1;
+    owner->is_remembered = true;
+  }
+
+  // the marker may already be past owner
+  if(gc->phase == Gc_Marking && owner->is_marked)
+    mark_object(env, object, false);
+}
+
+static void minor_collect(Env* env) {
+  Gc* gc = &env->gc;
+#ifdef GC_LOG
+  size_t before = gc->nursery_bytes;
+#endif
+  // a major collection may have gray objects pending below base
+  i32 base = gc->gray_count;
+
+  mark_values(env, env->stack, env->stack_top - env->stack, true);
+  for(i32 x = 0; x < gc->dirty_count; x+=1) {
+    i32 slot = gc->dirty_globals[x];
+    mark_value(env, env->global_values.data[slot], true);
+    gc->global_cards.data[slot] = 0;
+  }
+  mark_values(env, env->constants.data + gc->old_constants,
+    env->constants.count - gc->old_constants, true);
+  mark_values(env, env->global_names.data + gc->old_global_names,
+    env->global_names.count - gc->old_global_names, true);
+  for(i32 x = 0; x < gc->remembered_count; x+=1) {
+    blacken_object(env, gc->remembered[x], true);
+    gc->remembered[x]->is_remembered = false;
+  }
+  trace_references(env, base, true, -1);
+  table_remove_unmarked(&env->interned_strings, true);
+
+  size_t promoted = 0;
+  Object* object = gc->nursery;
+  while(object != NULL) {
+    Object* next = object->next;
+    if(object->is_marked) {
+      // survivors of a running major collection are live for it as well
+      object->is_old = true;
+      object->is_marked = gc->phase == Gc_Marking;
+      if(object->is_marked) gray_push(gc, object);
+      object->next = env->objects;
+      env->objects = object;
+      promoted += object_size(object);
+    }
+    else free_object(object);
+    object = next;
+  }
+
+  gc->nursery = NULL;
+  gc->nursery_bytes = 0;
+  gc->bytes_allocated += promoted;
+  gc->remembered_count = 0;
+  gc->dirty_count = 0;
+  gc->old_constants = env->constants.count;
+  gc->old_global_names = env->global_names.count;
+
+#ifdef GC_LOG
+  fprintf(stderr, "gc: minor %zu bytes, promoted %zu\n", before, promoted);
+#endif
+}
+
+// atomic end of the mark phase, nothing young is left after it
+static void finish_marking(Env* env) {
+  Gc* gc = &env->gc;
+  minor_collect(env);
+  mark_roots(env);
+  trace_references(env, 0, false, -1);
+  table_remove_unmarked(&env->interned_strings, false);
+
+  gc->sweeping = env->objects;
+  env->objects = NULL;
+  gc->phase = Gc_Sweeping;
+}
+
+// returns true once the whole old generation was swept
+static bool sweep_old(Env* env, i32 budget) {
+  Gc* gc = &env->gc;
+  for(i32 done = 0; gc->sweeping != NULL; done+=1) {
+    if(budget >= 0 && done >= budget) return false;
+    Object* object = gc->sweeping;
+    gc->sweeping = object->next;
+
+    if(object->is_marked) {
+      object->is_marked = false;
+      object->next = env->objects;
+      env->objects = object;
+    }
+    else {
+      size_t size = object_size(object);
+      gc->bytes_allocated -= size < gc->bytes_allocated ? size : gc->bytes_allocated;
+      free_object(object);
+    }
+  }
+
+  gc->phase = Gc_Idle;
+  gc->next_gc = gc->bytes_allocated * gc->grow_factor;
+  if(gc->next_gc < gc->min_heap)
+    gc->next_gc = gc->min_heap;
+#ifdef GC_LOG
+  fprintf(stderr, "gc: major done, %zu bytes old, next at %zu\n",
+    gc->bytes_allocated, gc->next_gc);
+#endif
+  return true;
+}
+
+// full collection of both generations, finishes a running incremental one
+void collect_garbage(Env* env) {
+  Gc* gc = &env->gc;
+  if(gc->phase != Gc_Sweeping) {
+    gc->phase = Gc_Marking;
+    finish_marking(env);
+  }
+  sweep_old(env, -1);
+}
+
+// called before every object allocation
+void gc_maybe_collect(Env* env) {
+#ifdef GC_STRESS
+  collect_garbage(env);
+#else
+  Gc* gc = &env->gc;
+  if(gc->phase == Gc_Marking) {
+    if(trace_references(env, 0, false, gc->step_budget))
+      finish_marking(env);
+  }
+  else if(gc->phase == Gc_Sweeping)
+    sweep_old(env, gc->step_budget);
+
+  if(gc->nursery_bytes > gc->nursery_size) {
+    minor_collect(env);
+    if(gc->phase == Gc_Idle && gc->bytes_allocated > gc->next_gc) {
+      if(gc->step_budget > 0) {
+        gc->phase = Gc_Marking;
+        mark_roots(env);
+      }
+      else collect_garbage(env);
+    }
+  }
+#endif
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "common.h"
+#include "object.h"
+
+// Heap growth knobs for the old generation. The first major collection runs
+// once Gc_Min_Heap bytes were promoted, after that whenever the old
+// generation grew by Gc_Grow_Factor since the last one. New objects go to a
+// nursery of Gc_Nursery_Size bytes which is emptied by a minor collection
+// when full. Gc_Step_Budget is the number of objects an incremental major
+// collection marks or sweeps per allocation, 0 does the whole major
+// collection in one go. all of them can be overridden from the Makefile and
+// at startup through PLAY_GC_* (see main.c)
+#ifndef Gc_Min_Heap
+  #define Gc_Min_Heap (1024 * 1024)
+#endif
+#ifndef Gc_Grow_Factor
+  #define Gc_Grow_Factor 2.0
+#endif
+#ifndef Gc_Nursery_Size
+  #define Gc_Nursery_Size (256 * 1024)
+#endif
+#ifndef Gc_Step_Budget
+  #define Gc_Step_Budget 0
+#endif
+
+typedef enum {
+  Gc_Idle,
+  Gc_Marking,
+  Gc_Sweeping,
+} Gc_Phase;
+
+typedef struct {
+  Object* nursery;        // young objects, only reclaimed by minor collections
+  Object* sweeping;       // old objects an incremental sweep hasn't visited
+  size_t nursery_bytes;
+  size_t nursery_size;
+  size_t bytes_allocated; // old generation only
+  size_t next_gc;
+  size_t min_heap;
+  double grow_factor;
+  i32 step_budget;
+  Gc_Phase phase;
+
+  Object** gray_stack;
+  i32 gray_count, gray_cap;
+
+  // old objects that had a young object stored into them since the last
+  // minor collection
+  Object** remembered;
+  i32 remembered_count, remembered_cap;
+
+  // global slots that had a young object stored into them, global_cards
+  // has one byte per slot so a slot is only listed once
+  i32* dirty_globals;
+  i32 dirty_count, dirty_cap;
+  byte_vector global_cards;
+
+  // constants and global names below these were already promoted
+  i32 old_constants;
+  i32 old_global_names;
+} Gc;
+
+#define Object_isYoung(ob) (!(ob)->is_old)
+
+typedef struct Env Env;
+void gc_allocate(Gc* gc);
+void gc_deallocate(Env* env);
+void gc_account(Env* env, size_t bytes);
+void gc_maybe_collect(Env* env);
+void gc_write_barrier(Env* env, Object* owner, value val);
+void gc_remember_global(Env* env, i32 slot);
+void gc_drop_constants(Env* env, i32 count);
+void collect_garbage(Env* env);
+size_t object_size(Object* object);
@@ -0,0 +1,489 @@
+#include <string.h>
+#include "image.h"
+#include "object.h"
+
+// Layout of a compiled image, all numbers little endian:
+//
+//   header (20 bytes)
+//     magic        4 bytes, Image_Magic
+//     version      u16, Image_Version
+//     flags        u16, always 0 for now
+//     hash_check   u32, see hash_check(). stored string hashes are only
+//                  used if the loader's String_Hash agrees
+//     payload_len  u32
+//     checksum     u32, hash_words of the payload
+//   payload
+//     u32 global count, then that many strings in slot order
+//     u32 constant count, then that many values
+//     u32 code length, then env->stream
+//
+// A string is u32 len, u32 hash, len bytes and a 0 so the loader can leave
+// it where it is (see borrow_string). A value is a tag byte followed by 8
+// bytes holding the bits of a number, a string, or u32 count and that many
+// values for a list. null, true and false are the tag alone. A procedure
+// is its name as a string, u32 arity, u32 code length and its code.
+
+#define Header_Size 20
+// lists are kept alive on the eval stack while their elements are loaded
+#define Image_Max_Depth 64
+
+enum {
+  Tag_Image_Null,
+  Tag_Image_False,
+  Tag_Image_True,
+  Tag_Image_Number,
+  Tag_Image_String,
+  Tag_Image_List,
+  Tag_Image_Function,
+};
+
+// strings shorter than Hash_Short_Len and longer ones hash differently, so
+// a probe is hashed at every length up to well past that point. a loader
+// with another String_Hash, Hash_Short_Len or hash_words gets another value
+static u32 hash_check(void) {
+  char probe[Hash_Short_Len + 32];
+  u32 check = String_Hash(Image_Magic, 4);
+  for(i32 x = 0; x < (i32)sizeof(probe); x+=1) {
+    probe[x] = Image_Magic[x & 3] + x;
+    check = check * 31 + String_Hash(probe, x +1);
+  }
+  return check;
+}
+
+static void put_u16(byte_vector* out, uint16_t val) {
+  byte_vector_pushback(out, val & 0xFF);
+  byte_vector_pushback(out, (val >> 8) & 0xFF);
+}
+
+static void put_u32(byte_vector* out, u32 val) {
+  for(i32 x = 0; x < 4; x+=1)
+    byte_vector_pushback(out, (val >> (8 * x)) & 0xFF);
+}
+
+static void put_bytes(byte_vector* out, char* bytes, i32 len) {
+  for(i32 x = 0; x < len; x+=1)
+    byte_vector_pushback(out, bytes[x]);
+}
+
+static void put_string(byte_vector* out, Object_String* string) {
+  put_u32(out, string->len);
+  put_u32(out, string_hash(string));
+  put_bytes(out, string->str, string->len);
+  byte_vector_pushback(out, 0);
+}
+
+static bool put_value(byte_vector* out, value val, i32 depth) {
+  if(Value_isNull(val))
+    byte_vector_pushback(out, Tag_Image_Null);
+  else if(Value_isBool(val))
+    byte_vector_pushback(out, Value_asBool(val) ? Tag_Image_True : Tag_Image_False);
+  else if(Value_isNumber(val)) {
+    double num = Value_asNumber(val);
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+    byte_vector_pushback(out, Tag_Image_Number);
+    put_u32(out, (u32)bits);
+    put_u32(out, (u32)(bits >> 32));
+  }
+  else if(Object_isString(val)) {
+    byte_vector_pushback(out, Tag_Image_String);
+    put_string(out, Object_asString(val));
+  }
+  else if(Object_isList(val) && depth < Image_Max_Depth) {
+    value_vector* elems = &Object_asList(val)->vector;
+    byte_vector_pushback(out, Tag_Image_List);
+    put_u32(out, elems->count);
+    for(i32 x = 0; x < elems->count; x+=1)
+      if(!put_value(out, elems->data[x], depth +1)) return false;
+  }
+  else if(Object_isFunction(val)) {
+    Object_Function* fn = Object_asFunction(val);
+    byte_vector_pushback(out, Tag_Image_Function);
+    put_string(out, fn->name);
+    put_u32(out, fn->arity);
+    put_u32(out, fn->code.count);
+    put_bytes(out, (char*)fn->code.data, fn->code.count);
+  }
+  else return false;
+  return true;
+}
+
+bool image_write(Env* env, const char* path) {
+  byte_vector out;
+  byte_vector_allocate(&out);
+  for(i32 x = 0; x < Header_Size; x+=1)
+    byte_vector_pushback(&out, 0);
+
+  put_u32(&out, env->global_names.count);
+  for(i32 x = 0; x < env->global_names.count; x+=1)
+    put_string(&out, Object_asString(env->global_names.data[x]));
+
+  bool ok = true;
+  put_u32(&out, env->constants.count);
+  for(i32 x = 0; x < env->constants.count && ok; x+=1)
+    ok = put_value(&out, env->constants.data[x], 0);
+  if(!ok) {
+    fprintf(stderr, "ERROR: %s: constant can't be stored in an image\n", path);
+    byte_vector_deallocate(&out);
+    return false;
+  }
+
+  put_u32(&out, env->stream.count);
+  put_bytes(&out, (char*)env->stream.data, env->stream.count);
+
+  // fill in the header now that the payload is known
+  i32 payload_len = out.count - Header_Size;
+  i32 end = out.count;
+  out.count = 0;
+  put_bytes(&out, Image_Magic, 4);
+  put_u16(&out, Image_Version);
+  put_u16(&out, 0);
+  put_u32(&out, hash_check());
+  put_u32(&out, payload_len);
+  put_u32(&out, hash_words((char*)out.data + Header_Size, payload_len));
+  out.count = end;
+
+  FILE* fptr = fopen(path, "wb");
+  if(fptr == NULL) {
+    fprintf(stderr, "ERROR: %s: %s\n", path, strerror(errno));
+    byte_vector_deallocate(&out);
+    return false;
+  }
+  ok = fwrite(out.data, 1, out.count, fptr) == (size_t)out.count;
+  ok = fclose(fptr) == 0 && ok;
+  if(!ok)
+    fprintf(stderr, "ERROR: %s: %s\n", path, strerror(errno));
+  byte_vector_deallocate(&out);
+  return ok;
+}
+
+typedef struct {
+  byte* at;
+  byte* end;
+  bool failed;        // ran past the end or found something malformed
+  bool trust_hashes;  // stored string hashes match String_Hash
+} Reader;
+
+static byte* get_bytes(Reader* reader, u32 len) {
+  if(reader->failed || (size_t)(reader->end - reader->at) < len) {
+    reader->failed = true;
+    return NULL;
+  }
+  byte* bytes = reader->at;
+  reader->at += len;
+  return bytes;
+}
+
+static u32 get_u32(Reader* reader) {
+  byte* bytes = get_bytes(reader, 4);
+  if(bytes == NULL) return 0;
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((u32)bytes[3] << 24);
+}
+
+static Object_String* get_string(Env* env, Reader* reader) {
+  u32 len = get_u32(reader);
+  u32 hash = get_u32(reader);
+  if(len >= INT32_MAX) {
+    reader->failed = true;
+    return NULL;
+  }
+  char* bytes = (char*)get_bytes(reader, len +1);
+  if(bytes == NULL || bytes[len] != '\0') {
+    reader->failed = true;
+    return NULL;
+  }
+  if(!reader->trust_hashes)
+    hash = String_Hash(bytes, len);
+  return borrow_string(env, bytes, len, hash);
+}
+
+static value get_value(Env* env, Reader* reader, i32 depth) {
+  byte* tag = get_bytes(reader, 1);
+  if(tag == NULL) return Value_Null();
+
+  switch(*tag) {
+    case Tag_Image_Null: return Value_Null();
+    case Tag_Image_False: return Value_Bool(false);
+    case Tag_Image_True: return Value_Bool(true);
+    case Tag_Image_Number: {
+      uint64_t bits = get_u32(reader);
+      bits |= (uint64_t)get_u32(reader) << 32;
+      double num;
+      memcpy(&num, &bits, sizeof(num));
+      // with NaN boxing some NaNs would come out as null or an object
+      if(!Value_isNumber(Value_Number(num))) break;
+      return Value_Number(num);
+    }
+    case Tag_Image_String: {
+      Object_String* string = get_string(env, reader);
+      return string != NULL ? Value_Object(string) : Value_Null();
+    }
+    case Tag_Image_List: {
+      u32 count = get_u32(reader);
+      // every element takes at least its tag byte
+      if(depth >= Image_Max_Depth || count > (size_t)(reader->end - reader->at))
+        break;
+      Object_List* list = allocate_list_cap(env, count);
+      *env->stack_top = Value_Object(list);
+      env->stack_top += 1;
+      for(u32 x = 0; x < count && !reader->failed; x+=1) {
+        value elem = get_value(env, reader, depth +1);
+        value_vector_pushback(&list->vector, elem);
+        gc_write_barrier(env, (Object*)list, elem);
+      }
+      env->stack_top -= 1;
+      return Value_Object(list);
+    }
+    case Tag_Image_Function: {
+      Object_Function* fn = make_function(env);
+      *env->stack_top = Value_Object(fn);
+      env->stack_top += 1;
+      fn->name = get_string(env, reader);
+      if(fn->name != NULL)
+        gc_write_barrier(env, (Object*)fn, Value_Object(fn->name));
+      fn->arity = get_u32(reader);
+      u32 code_len = get_u32(reader);
+      byte* code = get_bytes(reader, code_len);
+      if(code != NULL && code_len > 0) {
+        fn->code.data = REALLOCATE(byte, fn->code.data, code_len);
+        memcpy(fn->code.data, code, code_len);
+        fn->code.count = fn->code.cap = code_len;
+      }
+      env->stack_top -= 1;
+      return Value_Object(fn);
+    }
+  }
+  reader->failed = true;
+  return Value_Null();
+}
+
+static bool is_jump(byte inst) {
+  return inst == Op_Jump || inst == Op_Jump_If_False ||
+    inst == Op_Jump_If_False_Pop || inst == Op_Loop ||
+    inst == Op_Jump_If_Local_Ge_Const;
+}
+
+// how many values an instruction takes off the eval stack and how many it
+// puts back, one that only peeks at a value takes it and puts it back
+static void stack_effect(byte* at, i32* pops, i32* pushes) {
+  *pops = 0;
+  *pushes = 1;
+  switch(at[0]) {
+    case Op_Neg: case Op_Not: case Op_Set_Global_Slot: case Op_Set_Local:
+    case Op_Jump_If_False:
+      *pops = 1;
+      break;
+    case Op_Add: case Op_Sub: case Op_Mul: case Op_Div: case Op_Less:
+    case Op_Greater: case Op_Equal: case Op_Less_Equal: case Op_Greater_Equal:
+    case Op_Not_Equal: case Op_List_Subscript: case Op_List_Append:
+      *pops = 2;
+      break;
+    case Op_List_Store: case Op_List_Slice:
+      *pops = 3;
+      break;
+    case Op_Build_List:
+      *pops = (at[1] << 8) | at[2];
+      break;
+    case Op_List_Extend:
+      *pops = ((at[1] << 8) | at[2]) +1;
+      break;
+    case Op_Build_Dict:
+      *pops = ((at[1] << 8) | at[2]) * 2;
+      break;
+    case Op_Call:
+      *pops = at[1] +1;
+      break;
+    case Op_Print: case Op_Pop: case Op_Define_Global_Slot:
+    case Op_Jump_If_False_Pop:
+      *pops = 1;
+      *pushes = 0;
+      break;
+    case Op_Dict_Delete:
+      *pops = 2;
+      *pushes = 0;
+      break;
+    case Op_Jump: case Op_Loop: case Op_Return: case Op_Add_Local_Const:
+    case Op_Inc_Local_Const: case Op_Jump_If_Local_Ge_Const:
+      *pushes = 0;
+      break;
+  }
+}
+
+// the interpreter trusts its bytecode, so loaded code gets the checks the
+// compiler otherwise guarantees. a first walk wants every opcode known and
+// fitting, constant indices and global slots that exist and code that ends
+// in a return. a second one follows the control flow from the entry and
+// tracks the stack height above the frame's slots: no instruction may take
+// more than is there, locals have to be below the height, every jump lands
+// on an instruction and each instruction is reached at one height only.
+// that keeps the depth within the code length, which stack_reserve relies
+// on. fn is NULL for env->stream. types are not tracked, the handlers check
+// the ones they depend on
+static bool check_code(Env* env, Object_Function* fn) {
+  byte* code = fn != NULL ? fn->code.data : env->stream.data;
+  i32 len = fn != NULL ? fn->code.count : env->stream.count;
+  i32 base = fn != NULL ? fn->arity : 0;
+  if(len == 0 || base < 0 || base > UINT8_MAX) return false;
+
+  bool ok = true;
+  i32 last = 0;
+  for(i32 offset = 0; offset < len && ok; offset += opcode_length(code[offset])) {
+    byte inst = code[offset];
+    byte* operand = &code[offset +1];
+    last = offset;
+    if(!opcode_valid(inst) || offset + opcode_length(inst) > len) {
+      ok = false;
+      break;
+    }
+
+    i32 constant = -1, global = -1;
+    switch(inst) {
+      case Op_Push_Constant:
+        constant = operand[0];
+        break;
+      case Op_Push_Constant_Long:
+        constant = (operand[0] << 16) | (operand[1] << 8) | operand[2];
+        break;
+      case Op_Add_Local_Const:
+      case Op_Jump_If_Local_Ge_Const:
+        constant = operand[1];
+        break;
+      case Op_Define_Global_Slot:
+      case Op_Set_Global_Slot:
+      case Op_Get_Global_Slot:
+        global = (operand[0] << 8) | operand[1];
+        break;
+    }
+    ok = constant < env->constants.count && global < env->global_values.count;
+  }
+  if(!ok || code[last] != Op_Return) return false;
+
+  // height at each instruction start, -2 until something reaches it and -1
+  // inside an instruction
+  i32* heights = ALLOCATE(i32, len);
+  i32* work = ALLOCATE(i32, len);
+  for(i32 x = 0; x < len; x+=1)
+    heights[x] = -1;
+  for(i32 x = 0; x < len; x += opcode_length(code[x]))
+    heights[x] = -2;
+  heights[0] = base;
+  work[0] = 0;
+  i32 pending = 1;
+
+  while(pending > 0 && ok) {
+    pending -= 1;
+    i32 offset = work[pending];
+    byte inst = code[offset];
+    i32 height = heights[offset];
+    i32 next = offset + opcode_length(inst);
+    i32 pops, pushes;
+    stack_effect(&code[offset], &pops, &pushes);
+    // a procedure's return takes its result along
+    if(inst == Op_Return && fn != NULL)
+      pops = 1;
+
+    i32 local = -1;
+    if(inst == Op_Get_Local || inst == Op_Set_Local ||
+      inst == Op_Add_Local_Const || inst == Op_Inc_Local_Const ||
+      inst == Op_Jump_If_Local_Ge_Const)
+      local = code[offset +1];
+    else if(inst == Op_Dict_Next)
+      local = code[offset +1] +2;
+
+    ok = pops <= height && local < height &&
+      height - pops + pushes - base < len;
+    height = height - pops + pushes;
+
+    // both ways out of a conditional jump leave the same height
+    i32 targets[2] = {-1, -1};
+    if(is_jump(inst)) {
+      i32 distance = (code[next -2] << 8) | code[next -1];
+      targets[0] = inst == Op_Loop ? next - distance : next + distance;
+    }
+    if(inst != Op_Jump && inst != Op_Loop && inst != Op_Return)
+      targets[1] = next;
+
+    for(i32 x = 0; x < 2 && ok; x+=1) {
+      i32 target = targets[x];
+      if(target == -1) continue;
+      ok = target >= 0 && target < len && heights[target] != -1;
+      if(!ok) break;
+      if(heights[target] == -2) {
+        heights[target] = height;
+        work[pending] = target;
+        pending += 1;
+      }
+      else
+        ok = heights[target] == height;
+    }
+  }
+  FREE(heights);
+  FREE(work);
+  return ok;
+}
+
+bool image_is_image(char* bytes, size_t len) {
+  return len >= Header_Size && memcmp(bytes, Image_Magic, 4) == 0;
+}
+
+// fills env from an image in bytes, env has to be freshly allocated. the
+// strings of the image point into bytes, which have to stay put until env
+// is deallocated
+bool image_load(Env* env, char* bytes, size_t len) {
+  if(!image_is_image(bytes, len)) {
+    fprintf(stderr, "ERROR: not a compiled image\n");
+    return false;
+  }
+  Reader reader = {(byte*)bytes +4, (byte*)bytes + Header_Size, false, false};
+  byte* version = get_bytes(&reader, 4);
+  u32 version_no = version[0] | (version[1] << 8);
+  if(version_no != Image_Version) {
+    fprintf(stderr, "ERROR: image version %u, expected %u\n", version_no,
+      Image_Version);
+    return false;
+  }
+  reader.trust_hashes = get_u32(&reader) == hash_check();
+  u32 payload_len = get_u32(&reader);
+  u32 checksum = get_u32(&reader);
+  if(payload_len != len - Header_Size ||
+    checksum != hash_words(bytes + Header_Size, payload_len)) {
+    fprintf(stderr, "ERROR: image is truncated or corrupt\n");
+    return false;
+  }
+  reader.end = (byte*)bytes + len;
+
+  u32 global_count = get_u32(&reader);
+  for(u32 x = 0; x < global_count && !reader.failed; x+=1) {
+    Object_String* name = get_string(env, &reader);
+    if(name != NULL && global_slot(env, name) != (i32)x)
+      reader.failed = true;
+  }
+
+  u32 constant_count = get_u32(&reader);
+  for(u32 x = 0; x < constant_count && !reader.failed; x+=1) {
+    value val = get_value(env, &reader, 0);
+    value_vector_pushback(&env->constants, val);
+  }
+
+  u32 code_len = get_u32(&reader);
+  byte* code = get_bytes(&reader, code_len);
+  if(code != NULL && code_len > 0) {
+    env->stream.data = REALLOCATE(byte, env->stream.data, code_len);
+    memcpy(env->stream.data, code, code_len);
+    env->stream.count = env->stream.cap = code_len;
+  }
+
+  if(reader.failed || reader.at != reader.end) {
+    fprintf(stderr, "ERROR: malformed image\n");
+    return false;
+  }
+
+  bool ok = check_code(env, NULL);
+  for(i32 x = 0; x < env->constants.count && ok; x+=1) {
+    if(Object_isFunction(env->constants.data[x]))
+      ok = check_code(env, Object_asFunction(env->constants.data[x]));
+  }
+  if(!ok)
+    fprintf(stderr, "ERROR: image holds invalid bytecode\n");
+  return ok;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "common.h"
+#include "machine.h"
+
+// Compiled images (.chc): the optimized bytecode of a script together with
+// its constants and global names, so it can run without the parser. see
+// image.c for the layout. Image_Version is bumped whenever the layout or the
+// meaning of an opcode changes, an image of another version is refused.
+#define Image_Magic   "CHC\0"
+#define Image_Version 7
+
+bool image_is_image(char* bytes, size_t len);
+bool image_write(Env* env, const char* path);
+bool image_load(Env* env, char* bytes, size_t len);
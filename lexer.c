@@ -24,7 +24,7 @@ static void ignore_whitespace(void) {
       advance();
 
     if(lexer.current[0] == '#')
-      while(lexer.current[0] != '\n')
+      while(lexer.current[0] != '\n' && lexer.current[0] != '\0')
         advance();
     else
       return;
@@ -39,20 +39,22 @@ static Token make_token(i32 kind) {
   };
 }
 
+// the closing quote is only consumed once it is there, the source may end
+// in the 0 right behind the last line
 static Token string() {
-  char c = lexer.current[0];
-
-  while(c != '"') {
-    if(c == '\n')
+  while(lexer.current[0] != '"') {
+    if(lexer.current[0] == '\n' || lexer.current[0] == '\0')
       return error_token("Unterminated String");
-    else
-      c = advance();
+    advance();
   }
+  advance();
   return make_token(Tk_String);
 }
 
+// the whole word has to match, "input" isn't "in" followed by something
 i32 check_keyword(i32 idx, i32 len, char* rest, i32 kind) {
-  if(!strncmp(lexer.begin +idx, rest, len))
+  if(lexer.current - lexer.begin == idx + len &&
+    !strncmp(lexer.begin +idx, rest, len))
     return kind;
   else
     return Tk_Identifier;
@@ -62,7 +64,15 @@ static i32 identifier_or_keyword_kind() {
   switch(lexer.begin[0]) {
     case 'a': return check_keyword(1, 2, "nd", Tk_And);
     case 'o': return check_keyword(1, 1, "r", Tk_Or); 
-    case 'i': return check_keyword(1, 1, "f", Tk_If);
+    case 'i': {
+      if(lexer.current - lexer.begin > 1) {
+        switch(lexer.begin[1]) {
+          case 'f': return check_keyword(2, 0, "", Tk_If);
+          case 'n': return check_keyword(2, 0, "", Tk_In);
+        }
+      }
+    } break;
+    case 'd': return check_keyword(1, 5, "elete", Tk_Delete);
     case 'e': return check_keyword(1, 3, "lse", Tk_Else);
     case 'w': return check_keyword(1, 4, "hile", Tk_While);
     case 't': return check_keyword(1, 3, "rue", Tk_True);
@@ -152,6 +162,7 @@ Token next_token(void) {
     case '}': return make_token(Tk_Right_Brace);
     case ',': return make_token(Tk_Comma);
     case ';': return make_token(Tk_Semicolon);
+    case ':': return make_token(Tk_Colon);
   }
   return error_token("Unexpected Character");
 }
@@ -5,7 +5,7 @@ enum {
   Tk_Error, Tk_Eof,
   Tk_Right_Brace, Tk_Left_Brace, Tk_Left_Paren, Tk_Right_Paren,
   Tk_Left_SqrParen, Tk_Right_SqrParen,
-  Tk_Comma, Tk_Semicolon,
+  Tk_Comma, Tk_Semicolon, Tk_Colon,
 
   Tk_Plus, Tk_Minus, Tk_Star, Tk_Slash,
   Tk_Plus_Equal, Tk_Minus_Equal, Tk_Star_Equal, Tk_Slash_Equal,
@@ -17,7 +17,8 @@ enum {
   Tk_True, Tk_False,
 
   Tk_For, Tk_While, Tk_If, Tk_Else,
-  Tk_Print, Tk_Proc, Tk_Return, Tk_Let, Tk_Null
+  Tk_Print, Tk_Proc, Tk_Return, Tk_Let, Tk_Null,
+  Tk_In, Tk_Delete
 };
 
 typedef struct {
@@ -1,6 +1,8 @@
 #include <stdarg.h>
 #include "object.h"
 #include "machine.h"
+#include "gc.h"
+#include "array.h"
 
 static char* opc_to_str[] = {
   [Op_Push_Constant] = "PUSH_CONSTANT",
@@ -19,80 +21,178 @@ static char* opc_to_str[] = {
   [Op_Neg] = "NEGATE",
   [Op_Print] = "PRINT",
   [Op_Pop] = "POP",
-  [Op_Define_Global] = "DEFINE_GLOBAL",
-  [Op_Set_Global] = "SET_GLOBAL",
-  [Op_Get_Global] = "GET_GLOBAL",
+  [Op_Define_Global_Slot] = "DEFINE_GLOBAL_SLOT",
+  [Op_Set_Global_Slot] = "SET_GLOBAL_SLOT",
+  [Op_Get_Global_Slot] = "GET_GLOBAL_SLOT",
   [Op_Set_Local] = "SET_LOCAL",
   [Op_Get_Local] = "GET_LOCAL",
   [Op_Jump_If_False] = "JUMP_IF_FALSE",
   [Op_Jump] = "JUMP",
   [Op_Loop] = "LOOP",
   [Op_Build_List] = "BUILD_LIST",
-  [Op_List_Subscript] = "LIST_SUBSCRIPT"
+  [Op_List_Subscript] = "LIST_SUBSCRIPT",
+  [Op_Push_Constant_Long] = "PUSH_CONSTANT_LONG",
+  [Op_Call] = "CALL",
+  [Op_List_Store] = "LIST_STORE",
+  [Op_List_Append] = "LIST_APPEND",
+  [Op_List_Slice] = "LIST_SLICE",
+  [Op_List_Extend] = "LIST_EXTEND",
+  [Op_Build_Dict] = "BUILD_DICT",
+  [Op_Dict_Delete] = "DICT_DELETE",
+  [Op_Dict_Next] = "DICT_NEXT",
+  [Op_Less_Equal] = "CHECK_LESS_EQUAL",
+  [Op_Greater_Equal] = "CHECK_GREATER_EQUAL",
+  [Op_Not_Equal] = "CHECK_NOT_EQUAL",
+  [Op_Jump_If_False_Pop] = "JUMP_IF_FALSE_POP",
+  [Op_Add_Local_Const] = "ADD_LOCAL_CONST",
+  [Op_Inc_Local_Const] = "INC_LOCAL_CONST",
+  [Op_Jump_If_Local_Ge_Const] = "JUMP_IF_LOCAL_GE_CONST",
 };
 
+// instruction sizes with operands, anything not listed is 1 byte
+static i32 opc_to_len[UINT8_MAX +1] = {
+  [Op_Push_Constant] = 2,
+  [Op_Define_Global_Slot] = 3,
+  [Op_Set_Global_Slot] = 3,
+  [Op_Get_Global_Slot] = 3,
+  [Op_Set_Local] = 2,
+  [Op_Get_Local] = 2,
+  [Op_Jump_If_False] = 3,
+  [Op_Jump] = 3,
+  [Op_Loop] = 3,
+  [Op_Build_List] = 3,
+  [Op_Push_Constant_Long] = 4,
+  [Op_Call] = 2,
+  [Op_List_Extend] = 3,
+  [Op_Build_Dict] = 3,
+  [Op_Dict_Next] = 2,
+  [Op_Jump_If_False_Pop] = 3,
+  [Op_Add_Local_Const] = 3,
+  [Op_Inc_Local_Const] = 3,
+  [Op_Jump_If_Local_Ge_Const] = 5,
+};
+
+i32 opcode_length(byte inst) {
+  return opc_to_len[inst] ? opc_to_len[inst] : 1;
+}
+
+// false for Op_Error and anything past the last opcode
+bool opcode_valid(byte inst) {
+  return inst < sizeof(opc_to_str) / sizeof(opc_to_str[0]) && opc_to_str[inst] != NULL;
+}
+
 void env_allocate(Env* env) {
   byte_vector_allocate(&env->stream);
   value_vector_allocate(&env->constants);
-  value_vector_allocate(&env->eval_stack);
+  env->stack = ALLOCATE(value, Stack_Min);
+  env->stack_top = env->stack;
+  env->stack_cap = Stack_Min;
+  env->frame_count = 0;
   table_allocate(&env->interned_strings);
   table_allocate(&env->globals);
+  value_vector_allocate(&env->global_values);
+  value_vector_allocate(&env->global_names);
   env->objects = NULL;
+  gc_allocate(&env->gc);
+}
+
+// returns the slot of a global, a new name gets the next free slot which
+// stays undefined until an Op_Define_Global_Slot runs for it
+i32 global_slot(Env* env, Object_String* name) {
+  Entry* entry = table_get_entry(&env->globals, Value_Object(name));
+  if(entry != NULL)
+    return (i32)Value_asNumber(entry->val);
+
+  i32 slot = env->global_values.count;
+  value_vector_pushback(&env->global_values, Value_Undefined());
+  value_vector_pushback(&env->global_names, Value_Object(name));
+  byte_vector_pushback(&env->gc.global_cards, 0);
+  table_set(&env->globals, Value_Object(name), Value_Number(slot));
+  return slot;
+}
+
+// binds a native to a global of the given name. natives are defined before
+// anything is compiled or loaded so they get the same slots every run
+void define_native(Env* env, char* name, Native_Fn fn, i32 arity) {
+  Object_String* name_str = object_string_cpy(env, name, strlen(name));
+  i32 slot = global_slot(env, name_str);
+  Object_Native* native = make_native(env, fn, arity, name_str);
+  env->global_values.data[slot] = Value_Object(native);
+  if(Object_isYoung((Object*)native))
+    gc_remember_global(env, slot);
 }
 
 void env_deallocate(Env* env) {
   byte_vector_deallocate(&env->stream);
   value_vector_deallocate(&env->constants);
-  value_vector_deallocate(&env->eval_stack);
+  FREE(env->stack);
+  env->stack = env->stack_top = NULL;
+  env->stack_cap = 0;
   table_deallocate(&env->interned_strings);
   table_deallocate(&env->globals);
+  value_vector_deallocate(&env->global_values);
+  value_vector_deallocate(&env->global_names);
   free_objects(env);
+  gc_deallocate(env);
+
+  x_alloc_release();
 }
 
-static void eval_push(Env* env, value val) {
-  value_vector_pushback(&env->eval_stack, val);
+// out of line helpers work on env->stack_top. interpret() keeps its own copy
+// of the top in a local and writes it back before calling any of them
+static inline void eval_push(Env* env, value val) {
+  *env->stack_top = val;
+  env->stack_top += 1;
 }
-static value eval_pop(Env* env) {
-  return value_vector_pop(&env->eval_stack);
+static inline value eval_pop(Env* env) {
+  env->stack_top -= 1;
+  return *env->stack_top;
 }
-
-static value eval_peek(Env* env, i32 offset) {
-  i32 count = env->eval_stack.count;
-  return env->eval_stack.data[(count -1) - offset];
+static inline value eval_peek(Env* env, i32 offset) {
+  return env->stack_top[-1 - offset];
 }
 static void eval_reset_stack(Env* env) {
-  env->eval_stack.count = 0;
+  env->stack_top = env->stack;
+  env->frame_count = 0;
+}
+
+// Makes sure the slab can hold everything a frame of code_len bytes can
+// push. No instruction pushes more than one value, and loops leave the stack
+// as they found it, so the depth of a frame never exceeds its code length.
+// this is the only overflow check, pushes and pops themselves are unchecked.
+// a call only gets here when the slab is too small, the frames' slot
+// pointers are moved along with it
+static void stack_reserve(Env* env, i32 code_len) {
+  i32 used = env->stack_top - env->stack;
+  if(used + code_len <= env->stack_cap) return;
+
+  while(env->stack_cap < used + code_len)
+    env->stack_cap *= 2;
+  value* stack = ALLOCATE(value, env->stack_cap);
+  memcpy(stack, env->stack, sizeof(value) * used);
+  for(i32 x = 0; x < env->frame_count; x+=1)
+    env->frames[x].slots = stack + (env->frames[x].slots - env->stack);
+  FREE(env->stack);
+  env->stack = stack;
+  env->stack_top = env->stack + used;
 }
 
 void print_value(value data) {
-  switch(data.kind) {
-    case Vk_Bool:
-      printf("%s", Value_asBool(data) ? "true" : "false");
-      break;
-    case Vk_Number:
-      printf("%g", Value_asNumber(data));
-      break;
-    case Vk_Null:
-      printf("null");
-      break;
-    case Vk_Object:
-      print_object(data);
-      break;
-    case Vk_Error:
-      printf("Object is uninitialized. or clobbered");
-      break;
-    default: return;
-  }
+  if(Value_isBool(data))
+    printf("%s", Value_asBool(data) ? "true" : "false");
+  else if(Value_isNumber(data))
+    printf("%g", Value_asNumber(data));
+  else if(Value_isNull(data))
+    printf("null");
+  else if(Value_isObject(data))
+    print_object(data);
+  else
+    printf("Object is uninitialized. or clobbered");
 }
 
 static i32 opcode_byte2(byte inst, value data, i32 idx, i32 offset) {
   printf("%04i  %-20s %i ", offset, opc_to_str[inst], idx);
-  if(inst == Op_Define_Global || inst == Op_Get_Global) {
-    printf("(");
-    print_value(data);
-    printf(")");
-  }
-  else if (data.kind != Vk_Number) {
+  if (!Value_isNumber(data)) {
     printf("(\"");
     print_value(data);
     printf("\")");
@@ -106,6 +206,31 @@ static i32 opcode_byte2(byte inst, value data, i32 idx, i32 offset) {
   return offset +2;
 }
 
+static i32 opcode_constant_long(byte inst, value data, i32 idx, i32 offset) {
+  opcode_byte2(inst, data, idx, offset);
+  return offset +4;
+}
+
+static i32 opcode_local(byte inst, i32 slot, i32 offset) {
+  printf("%04i  %-20s %i\n", offset, opc_to_str[inst], slot);
+  return offset +2;
+}
+
+static i32 opcode_local_const(byte inst, value data, i32 slot, i32 offset) {
+  printf("%04i  %-20s %i (", offset, opc_to_str[inst], slot);
+  print_value(data);
+  printf(")\n");
+  return offset +3;
+}
+
+static i32 opcode_local_jump(byte inst, value data, i32 slot, i32 jump,
+  i32 offset) {
+  printf("%04i  %-20s %i (", offset, opc_to_str[inst], slot);
+  print_value(data);
+  printf(") Jmp: %i\n", offset + jump +5);
+  return offset +5;
+}
+
 static i32 opcode_byte1(byte inst, i32 offset) {
   printf("%04i  %-20s\n", offset, opc_to_str[inst]);
   return offset +1;
@@ -115,12 +240,18 @@ static i32 opcode_jump(byte inst, i32 idx, i32 sign, i32 offset) {
   printf("%04i  %-20s Jmp: %i\n", offset, opc_to_str[inst], offset + sign * idx +3);
   return offset +3;
 }
+static i32 opcode_global(byte inst, value name, i32 slot, i32 offset) {
+  printf("%04i  %-20s %i (", offset, opc_to_str[inst], slot);
+  print_value(name);
+  printf(")\n");
+  return offset +3;
+}
 static i32 opcode_byte3(byte inst, i32 idx, i32 offset) {
   printf("%04i  %-20s %i\n", offset, opc_to_str[inst], idx);
   return offset +3;
 }
 
-static void runtime_error(Env* env, char* fmt, ...) {
+void runtime_error(Env* env, char* fmt, ...) {
   va_list args;
   va_start(args, fmt);
   fputs("Runtime Error: ", stderr);
@@ -130,14 +261,13 @@ static void runtime_error(Env* env, char* fmt, ...) {
   eval_reset_stack(env);
 }
 
-void env_print_instructions(Env* env) {
+static void print_code(Env* env, byte_vector* code) {
   i32 offset = 0;
   i32 idx = 0;
   value data;
   byte inst = 0;
-  printf("=== Disassembled Bytecode ===\n");
-  while(offset < env->stream.count) {
-    inst = env->stream.data[offset];
+  while(offset < code->count) {
+    inst = code->data[offset];
 
     switch(inst) {
       case Op_Add:
@@ -155,30 +285,72 @@ void env_print_instructions(Env* env) {
       case Op_Print:
       case Op_Pop:
       case Op_List_Subscript:
+      case Op_List_Store:
+      case Op_List_Append:
+      case Op_List_Slice:
+      case Op_Dict_Delete:
+      case Op_Less_Equal:
+      case Op_Greater_Equal:
+      case Op_Not_Equal:
       case Op_Return: {
         offset = opcode_byte1(inst, offset);
       } break;
-      case Op_Define_Global:
-      case Op_Set_Global:
-      case Op_Get_Global:
+      case Op_Call:
+      case Op_Dict_Next:
       case Op_Set_Local:
-      case Op_Get_Local:
+      case Op_Get_Local: {
+        idx = code->data[offset +1];
+        offset = opcode_local(inst, idx, offset);
+      } break;
+      case Op_Add_Local_Const: {
+        idx = code->data[offset +1];
+        data = env->constants.data[code->data[offset +2]];
+        offset = opcode_local_const(inst, data, idx, offset);
+      } break;
+      case Op_Inc_Local_Const: {
+        idx = code->data[offset +1];
+        int8_t step = (int8_t)code->data[offset +2];
+        offset = opcode_local_const(inst, Value_Number(step), idx, offset);
+      } break;
+      case Op_Jump_If_Local_Ge_Const: {
+        byte* operand = &code->data[offset +1];
+        data = env->constants.data[operand[1]];
+        i32 jump = (operand[2] << 8) | operand[3];
+        offset = opcode_local_jump(inst, data, operand[0], jump, offset);
+      } break;
       case Op_Push_Constant: {
-        idx = env->stream.data[offset +1];
+        idx = code->data[offset +1];
         data = env->constants.data[idx];
         offset = opcode_byte2(inst, data, idx, offset);
       } break;
+      case Op_Push_Constant_Long: {
+        byte* operand = &code->data[offset +1];
+        idx = (operand[0] << 16) | (operand[1] << 8) | operand[2];
+        data = env->constants.data[idx];
+        offset = opcode_constant_long(inst, data, idx, offset);
+      } break;
       case Op_Loop:
       case Op_Jump:
+      case Op_Jump_If_False_Pop:
       case Op_Jump_If_False: {
-        byte low = env->stream.data[offset +1];
-        byte high = env->stream.data[offset +2];
+        byte low = code->data[offset +1];
+        byte high = code->data[offset +2];
         i32 idx = (low << 8) | high;
         offset = opcode_jump(inst, idx, inst == Op_Loop ? -1 : 1, offset);
       } break;
+      case Op_Define_Global_Slot:
+      case Op_Set_Global_Slot:
+      case Op_Get_Global_Slot: {
+        byte low = code->data[offset +1];
+        byte high = code->data[offset +2];
+        i32 slot = (low << 8) | high;
+        offset = opcode_global(inst, env->global_names.data[slot], slot, offset);
+      } break;
+      case Op_List_Extend:
+      case Op_Build_Dict:
       case Op_Build_List: {
-        byte low = env->stream.data[offset +1];
-        byte high = env->stream.data[offset +2];
+        byte low = code->data[offset +1];
+        byte high = code->data[offset +2];
         i32 idx = (low << 8) | high;
         offset = opcode_byte3(inst, idx, offset);
       } break;
@@ -187,14 +359,37 @@ void env_print_instructions(Env* env) {
         return;
     }
   }
+}
+
+// the script first, then every procedure
+void env_print_instructions(Env* env) {
+  printf("=== Disassembled Bytecode ===\n");
+  print_code(env, &env->stream);
   printf("=== End ===\n\n");
+
+  for(i32 x = 0; x < env->constants.count; x+=1) {
+    if(!Object_isFunction(env->constants.data[x])) continue;
+    Object_Function* fn = Object_asFunction(env->constants.data[x]);
+    printf("=== Disassembled proc %s ===\n", fn->name->str);
+    print_code(env, &fn->code);
+    printf("=== End ===\n\n");
+  }
 }
 
 bool is_falsey(value val) {
   return Value_isNull(val) || (Value_isBool(val) && !Value_asBool(val));
 }
 
-bool check_equality(value x, value y) {
+bool check_equality(Env* env, value x, value y) {
+#ifdef NAN_BOXING
+  // numbers still need a floating point compare (NaN != NaN, 0 == -0)
+  // everything else is equal only when the bits are
+  if(Value_isNumber(x) && Value_isNumber(y))
+    return Value_asNumber(x) == Value_asNumber(y);
+  if(Object_isStringLike(x) && Object_isStringLike(y))
+    return strings_equal(env, Value_asObject(x), Value_asObject(y));
+  return x == y;
+#else
   if (x.kind != y.kind) return false;
   switch(x.kind) {
     case Vk_Bool: return Value_asBool(x) == Value_asBool(y);
@@ -204,247 +399,873 @@ bool check_equality(value x, value y) {
     // when strings is are parsed and stored
     // machine's internal table is checked if already same string is present
     // if that's true then return the same string
-    // so comparing pointer is used here to check equality
-    case Vk_Object: return Value_asObject(x) == Value_asObject(y);
+    // so comparing pointer is used here to check equality. ropes aren't
+    // interned and are compared by their characters
+    case Vk_Object:
+      if(Object_isStringLike(x) && Object_isStringLike(y))
+        return strings_equal(env, Value_asObject(x), Value_asObject(y));
+      return Value_asObject(x) == Value_asObject(y);
     default: return false;
   }
+#endif
 }
 
+// long results become a rope so a string built up in a loop isn't copied
+// again on every + (see Rope_Min_Len)
 void concatenate_strings(Env* env) {
-  Object_String* y = Object_asString(eval_pop(env));
-  Object_String* x = Object_asString(eval_pop(env));
+  Object* y = Value_asObject(eval_peek(env, 0));
+  Object* x = Value_asObject(eval_peek(env, 1));
 
-  int len = x->len + y->len;
-  char* concat = ALLOCATE(char, len +1);
-  memcpy(concat, x->str, x->len);
-  memcpy(concat + x->len, y->str, y->len);
-  concat[len] = '\0';
+  int x_len = string_length(x);
+  int y_len = string_length(y);
 
-  Object_String* str = take_string(env, concat, len);
-  eval_push(env, Value_Object(str));
+  value result;
+  if(x_len + y_len >= Rope_Min_Len) {
+    // both operands stay on the stack while the rope is allocated
+    result = Value_Object(allocate_rope(env, x, y));
+  }
+  else {
+    int len = x_len + y_len;
+    char* concat = ALLOCATE(char, len +1);
+    memcpy(concat, string_chars(env, x, &x_len), x_len);
+    memcpy(concat + x_len, string_chars(env, y, &y_len), y_len);
+    concat[len] = '\0';
+    result = Value_Object(take_runtime_string(env, concat, len));
+  }
+  env->stack_top -= 2;
+  eval_push(env, result);
 }
 
+// the top elem_count values become the list with a single copy, they stay
+// on the stack while the list is allocated
 void build_list(Env* env, i32 elem_count) {
-  i32 start_idx = env->eval_stack.count - elem_count;
-  i32 end_idx = start_idx + elem_count;
-  Object_List* list = allocate_list(env);
-  for(i32 x = start_idx; x < end_idx; x+=1) {
-    value_vector_pushback(&list->vector, eval_peek(env, (elem_count -1) - x));
+  Object_List* list = allocate_list_cap(env, elem_count);
+  value* elems = env->stack_top - elem_count;
+  memcpy(list->vector.data, elems, sizeof(value) * elem_count);
+  list->vector.count = elem_count;
+  gc_account(env, sizeof(value) * list->vector.cap);
+  env->stack_top = elems;
+  eval_push(env, Value_Object(list));
+}
+
+// appends the top count values to the list right below them. literals with
+// more elements than Op_Build_List's operand holds are built in chunks
+void extend_list(Env* env, i32 count) {
+  value* elems = env->stack_top - count;
+  Object_List* list = Object_asList(elems[-1]);
+  i32 old_cap = list->vector.cap;
+  value_vector_reserve(&list->vector, list->vector.count + count);
+  memcpy(list->vector.data + list->vector.count, elems, sizeof(value) * count);
+  list->vector.count += count;
+  gc_account(env, sizeof(value) * (list->vector.cap - old_cap));
+
+  // the list may have been promoted while the chunk was evaluated
+  if(!Object_isYoung((Object*)list)) {
+    for(i32 x = 0; x < count; x+=1)
+      gc_write_barrier(env, (Object*)list, elems[x]);
+  }
+  env->stack_top = elems;
+}
+
+// the value a dictionary keeps key under, false once an error was reported.
+// strings are looked up by pointer so a string that isn't interned or a rope
+// is replaced by the interned string with the same characters. with add
+// false nothing new is interned, a string nobody interned can't be in any
+// dictionary and comes back as Value_Undefined()
+bool dict_key(Env* env, value key, bool add, value* result) {
+  *result = key;
+  if(Value_isNumber(key)) {
+    if(Value_asNumber(key) != Value_asNumber(key)) {
+      runtime_error(env, "NaN can't be a dictionary key");
+      return false;
+    }
+    return true;
   }
-  for(i32 x = 0; x < elem_count; x+=1) {
-    eval_pop(env);
+  if(Value_isNull(key) || Value_isBool(key)) return true;
+  if(!Object_isStringLike(key)) {
+    runtime_error(env, "Dictionary keys must be numbers, strings, bools or null");
+    return false;
   }
-  eval_push(env, Value_Object(list));
+  if(Object_isString(key) && Object_asString(key)->is_interned) return true;
+
+  int len;
+  char* chars = string_chars(env, Value_asObject(key), &len);
+  uint32_t hash = Object_isString(key) ? string_hash(Object_asString(key)) :
+    String_Hash(chars, len);
+  Object_String* interned = table_find_string(&env->interned_strings, chars,
+    len, hash);
+  // the key stays on the stack while its copy is allocated
+  if(interned == NULL && add)
+    interned = object_string_cpy(env, chars, len);
+  *result = interned != NULL ? Value_Object(interned) : Value_Undefined();
+  return true;
+}
+
+// the top count pairs of key and value become a dictionary, a key given
+// twice keeps the later value
+static bool build_dict(Env* env, i32 count) {
+  Object_Dict* dict = allocate_dict(env);
+  *env->stack_top = Value_Object(dict);
+  env->stack_top += 1;
+  value* pairs = env->stack_top -1 - count * 2;
+  for(i32 x = 0; x < count; x+=1) {
+    value key;
+    if(!dict_key(env, pairs[x * 2], true, &key)) return false;
+    dict_set(env, dict, key, pairs[x * 2 +1]);
+  }
+  env->stack_top = pairs;
+  eval_push(env, Value_Object(dict));
+  return true;
+}
+
+// replaces dict and key on the stack with the value stored under key
+static bool dict_get(Env* env) {
+  value key, val;
+  if(!dict_key(env, eval_peek(env, 0), false, &key)) return false;
+  Table* table = &Object_asDict(eval_peek(env, 1))->table;
+  if(Value_isUndefined(key) || !table_get(table, key, &val)) {
+    runtime_error(env, "Key not in dictionary");
+    return false;
+  }
+  env->stack_top -= 2;
+  eval_push(env, val);
+  return true;
+}
+
+// replaces dict, key and value on the stack with the value
+static bool dict_store(Env* env) {
+  value key;
+  if(!dict_key(env, eval_peek(env, 1), true, &key)) return false;
+  value val = eval_peek(env, 0);
+  dict_set(env, Object_asDict(eval_peek(env, 2)), key, val);
+  env->stack_top -= 3;
+  eval_push(env, val);
+  return true;
+}
+
+// element index of a list or a slice, NULL once an error was reported
+static value* list_element(Env* env, value list, value index) {
+  if(!Object_isListLike(list) || !Value_isNumber(index)) {
+    runtime_error(env, "Either Object is not subscriptable or Index is not a number");
+    return NULL;
+  }
+  i32 count;
+  value* values = list_values(list, &count);
+  double idx = Value_asNumber(index);
+  if(!(idx >= 0 && idx < count)) {
+    runtime_error(env, "Index %g out of range for %i elements", idx, count);
+    return NULL;
+  }
+  return &values[(i32)idx];
+}
+
+static double* array_element(Env* env, value array, value index) {
+  if(!Value_isNumber(index)) {
+    runtime_error(env, "Index is not a number");
+    return NULL;
+  }
+  double_vector* elems = &Object_asArray(array)->vector;
+  double idx = Value_asNumber(index);
+  if(!(idx >= 0 && idx < elems->count)) {
+    runtime_error(env, "Index %g out of range for %i elements", idx,
+      elems->count);
+    return NULL;
+  }
+  return &elems->data[(i32)idx];
+}
+
+// replaces x and y on the stack with x + y or x * y done element by element,
+// one of them is an array and the other an array of the same length or a
+// number. the result is a new array
+static bool array_arithmetic(Env* env, byte op) {
+  value y = eval_peek(env, 0);
+  value x = eval_peek(env, 1);
+  if(!Object_isArray(x)) {
+    // both operations commute
+    value tmp = x;
+    x = y;
+    y = tmp;
+  }
+  if(!Object_isArray(x) || !(Object_isArray(y) || Value_isNumber(y))) {
+    runtime_error(env, "%s: Operands must be numbers or arrays", opc_to_str[op]);
+    return false;
+  }
+  double_vector* xs = &Object_asArray(x)->vector;
+  i32 count = xs->count;
+  if(Object_isArray(y) && Object_asArray(y)->vector.count != count) {
+    runtime_error(env, "%s: Arrays of %i and %i elements", opc_to_str[op],
+      count, Object_asArray(y)->vector.count);
+    return false;
+  }
+
+  // both operands stay on the stack while the result is allocated
+  Object_Array* result = allocate_array(env, count);
+  double* dst = result->vector.data;
+  if(Object_isArray(y)) {
+    double* ys = Object_asArray(y)->vector.data;
+    if(op == Op_Add) array_add(dst, xs->data, ys, count);
+    else array_mul(dst, xs->data, ys, count);
+  }
+  else {
+    if(op == Op_Add) array_add_scalar(dst, xs->data, Value_asNumber(y), count);
+    else array_mul_scalar(dst, xs->data, Value_asNumber(y), count);
+  }
+  env->stack_top -= 2;
+  eval_push(env, Value_Object(result));
+  return true;
+}
+
+// slow path of the fused local updates: *local + k as Op_Add would do it,
+// for a local holding an array. local points into the eval stack, which
+// doesn't move while the result is allocated
+static bool add_to_local(Env* env, value* local, value k) {
+  eval_push(env, *local);
+  eval_push(env, k);
+  if(!array_arithmetic(env, Op_Add)) return false;
+  env->stack_top -= 1;
+  *local = *env->stack_top;
+  return true;
+}
+
+// a null bound is the start or the end of the list
+static bool slice_bound(Env* env, value bound, i32 fallback, i32* result) {
+  if(Value_isNull(bound)) {
+    *result = fallback;
+    return true;
+  }
+  if(!Value_isNumber(bound)) {
+    runtime_error(env, "Slice bounds must be numbers");
+    return false;
+  }
+  // NaN fails both tests
+  double num = Value_asNumber(bound);
+  if(!(num >= INT32_MIN && num <= INT32_MAX)) {
+    runtime_error(env, "Slice bound %g out of range", num);
+    return false;
+  }
+  *result = (i32)num;
+  return true;
 }
 
-bool interpret(Env* env) { 
+// replaces list, lo and hi on the stack with a slice, slices of a slice
+// point straight at its list. a slice of an array is a copy
+static bool slice_list(Env* env) {
+  value list = eval_peek(env, 2);
+  if(!Object_isListLike(list) && !Object_isArray(list)) {
+    runtime_error(env, "Only lists, slices and arrays can be sliced");
+    return false;
+  }
+  i32 count, lo, hi;
+  if(Object_isArray(list)) count = Object_asArray(list)->vector.count;
+  else list_values(list, &count);
+  if(!slice_bound(env, eval_peek(env, 1), 0, &lo) ||
+    !slice_bound(env, eval_peek(env, 0), count, &hi))
+    return false;
+  if(lo < 0 || lo > hi || hi > count) {
+    runtime_error(env, "Slice [%i:%i] out of range for %i elements", lo, hi,
+      count);
+    return false;
+  }
+
+  if(Object_isArray(list)) {
+    Object_Array* array = allocate_array(env, hi - lo);
+    if(hi > lo)
+      memcpy(array->vector.data, Object_asArray(list)->vector.data + lo,
+        sizeof(double) * (hi - lo));
+    env->stack_top -= 3;
+    eval_push(env, Value_Object(array));
+    return true;
+  }
+
+  Object_List* base = Object_isSlice(list) ? Object_asSlice(list)->list :
+    Object_asList(list);
+  i32 start = Object_isSlice(list) ? Object_asSlice(list)->start + lo : lo;
+  Object_Slice* slice = allocate_slice(env, base, start, hi - lo);
+  env->stack_top -= 3;
+  eval_push(env, Value_Object(slice));
+  return true;
+}
+
+// Instruction dispatch. The switch based loop is portable C and is always
+// available. With THREADED_DISPATCH (see Makefile) every handler jumps
+// straight to the next handler through a table of label addresses (GCC's
+// labels as values extension), this removes the bounds check of the switch
+// and gives every handler its own indirect branch which predicts far better.
+#if defined(THREADED_DISPATCH) && !defined(__GNUC__)
+  #undef THREADED_DISPATCH
+#endif
+
+// COUNT_DISPATCH counts every instruction executed and prints the profile
+// when the script returns. it is what the fused instructions were picked by
+#ifdef COUNT_DISPATCH
+  static uint64_t dispatch_counts[UINT8_MAX +1];
+  #define Count_Dispatch(op) (dispatch_counts[op] += 1);
+#else
+  #define Count_Dispatch(op)
+#endif
+
+#ifdef THREADED_DISPATCH
+  #define Vm_Loop()     Vm_Dispatch();
+  #define Vm_Dispatch() goto *dispatch_table[inst = *ip++]
+  #define Vm_Case(op)   Label_##op: Count_Dispatch(op)
+  #define Vm_Next()     Vm_Dispatch()
+  #define Vm_Default()  Label_Invalid:
+#else
+  #define Vm_Loop()     for(;;) switch(inst = *ip++)
+  #define Vm_Case(op)   case op: Count_Dispatch(op)
+  #define Vm_Next()     break
+  #define Vm_Default()  default:
+#endif
+
+#ifdef COUNT_DISPATCH
+static void print_dispatch_profile(void) {
+  uint64_t total = 0;
+  for(i32 x = 0; x <= UINT8_MAX; x+=1)
+    total += dispatch_counts[x];
+  fprintf(stderr, "=== Dispatch Profile: %llu instructions ===\n",
+    (unsigned long long)total);
+
+  // few opcodes, a selection sort is plenty
+  for(;;) {
+    i32 max = -1;
+    for(i32 x = 0; x <= UINT8_MAX; x+=1) {
+      if(dispatch_counts[x] && (max == -1 || dispatch_counts[x] > dispatch_counts[max]))
+        max = x;
+    }
+    if(max == -1) break;
+    fprintf(stderr, "%-26s %12llu  %5.1f%%\n", opc_to_str[max],
+      (unsigned long long)dispatch_counts[max], 100.0 * dispatch_counts[max] / total);
+    dispatch_counts[max] = 0;
+  }
+}
+#endif
+
+#define Read_Byte()   (ip += 1, ip[-1])
+#define Read_Short()  (ip += 2, (i32)((ip[-2] << 8) | ip[-1]))
+#define Read_Long()   (ip += 3, (i32)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+
+// stack access through the cached top, Store_Top()/Load_Top() sync it with
+// env->stack_top around calls that use the eval_* helpers
+#define Push(val)     (*sp = (val), sp += 1)
+#define Pop()         (sp -= 1, *sp)
+#define Peek(offset)  (sp[-1 - (offset)])
+#define Store_Top()   (env->stack_top = sp)
+#define Load_Top()    (sp = env->stack_top)
+
+// young objects stored in a global have to be found by the next minor
+// collection, see gc.c
+#define Global_Barrier(slot, val) \
+  do { \
+    if(Value_isObject(val) && Object_isYoung(Value_asObject(val))) \
+      gc_remember_global(env, slot); \
+  } while(0)
+
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+bool interpret(Env* env) {
   byte inst;
-  i32 i_count = env->stream.count;
-  i32 idx = 0;
   byte* ip = env->stream.data;
 
-  while(idx < i_count) {
-    inst = ip[idx];
-    switch(inst) {
-      case Op_Add: {
-        if(Object_isString(eval_peek(env, 0))
-          || Object_isString(eval_peek(env, 1))) {
-          concatenate_strings(env);
-        }
-        else if(Value_isNumber(eval_peek(env, 0)) 
-          || Value_isNumber(eval_peek(env, 1))) {
-          value y = eval_pop(env);
-          value x = eval_pop(env);
-          double r = Value_asNumber(x) + Value_asNumber(y);
-          eval_push(env, Value_Number(r));
-        }
-        else {
-          runtime_error(env, "Operands must be numbers");
-          return false; 
-        }
-        idx += 1;
-      } break;
-      case Op_Sub: {
-        if(!Value_isNumber(eval_peek(env, 0)) ||
-          !Value_isNumber(eval_peek(env, 1))) {
-          runtime_error(env, "%s: Operands must be numbers", opc_to_str[inst]);
-          return false; 
-        }
-        value y = eval_pop(env);
-        value x = eval_pop(env);
-        double r = Value_asNumber(x) - Value_asNumber(y);
-        eval_push(env, Value_Number(r));
-        idx += 1;
-      } break; 
-      case Op_Mul: {
-        if(!Value_isNumber(eval_peek(env, 0)) ||
-          !Value_isNumber(eval_peek(env, 1))) {
-          runtime_error(env, "%s: Operands must be numbers", opc_to_str[inst]);
-          return false; 
-        }
-        value y = eval_pop(env);
-        value x = eval_pop(env);
-        double r = Value_asNumber(x) * Value_asNumber(y);
-        eval_push(env, Value_Number(r));
-        idx += 1;
-      } break;
-      case Op_Div: {
-        if(!Value_isNumber(eval_peek(env, 0)) ||
-          !Value_isNumber(eval_peek(env, 1))) {
-          runtime_error(env, "%s: Operands must be numbers", opc_to_str[inst]);
-          return false; 
-        }
-        value y = eval_pop(env);
-        value x = eval_pop(env);
-        double r = Value_asNumber(x) / Value_asNumber(y);
-        eval_push(env, Value_Number(r));
-        idx += 1;
-      } break;
-      case Op_Less: {
-        if(!Value_isNumber(eval_peek(env, 0)) || 
-          !Value_isNumber(eval_peek(env, 1))) {
-          runtime_error(env, "Operands must be numbers");
-          return false; 
+  stack_reserve(env, env->stream.count);
+  Call_Frame* frame = &env->frames[0];
+  frame->function = NULL;
+  frame->slots = env->stack;
+  env->frame_count = 1;
+
+  // ip and slots are the running frame's, they are written back to it
+  // before a call and loaded from the caller on return
+  value* slots = frame->slots;
+  value* sp = env->stack_top;
+  value* globals = env->global_values.data;
+
+#ifdef THREADED_DISPATCH
+  static void* dispatch_table[UINT8_MAX +1] = {
+    [0 ... UINT8_MAX] = &&Label_Invalid,
+    [Op_Push_Constant] = &&Label_Op_Push_Constant,
+    [Op_Add] = &&Label_Op_Add,
+    [Op_Sub] = &&Label_Op_Sub,
+    [Op_Mul] = &&Label_Op_Mul,
+    [Op_Div] = &&Label_Op_Div,
+    [Op_Neg] = &&Label_Op_Neg,
+    [Op_Not] = &&Label_Op_Not,
+    [Op_True] = &&Label_Op_True,
+    [Op_False] = &&Label_Op_False,
+    [Op_Less] = &&Label_Op_Less,
+    [Op_Greater] = &&Label_Op_Greater,
+    [Op_Equal] = &&Label_Op_Equal,
+    [Op_Null] = &&Label_Op_Null,
+    [Op_Return] = &&Label_Op_Return,
+    [Op_Print] = &&Label_Op_Print,
+    [Op_Pop] = &&Label_Op_Pop,
+    [Op_Define_Global_Slot] = &&Label_Op_Define_Global_Slot,
+    [Op_Set_Global_Slot] = &&Label_Op_Set_Global_Slot,
+    [Op_Get_Global_Slot] = &&Label_Op_Get_Global_Slot,
+    [Op_Set_Local] = &&Label_Op_Set_Local,
+    [Op_Get_Local] = &&Label_Op_Get_Local,
+    [Op_Jump_If_False] = &&Label_Op_Jump_If_False,
+    [Op_Jump] = &&Label_Op_Jump,
+    [Op_Loop] = &&Label_Op_Loop,
+    [Op_Build_List] = &&Label_Op_Build_List,
+    [Op_List_Subscript] = &&Label_Op_List_Subscript,
+    [Op_Push_Constant_Long] = &&Label_Op_Push_Constant_Long,
+    [Op_Call] = &&Label_Op_Call,
+    [Op_List_Store] = &&Label_Op_List_Store,
+    [Op_List_Append] = &&Label_Op_List_Append,
+    [Op_List_Slice] = &&Label_Op_List_Slice,
+    [Op_List_Extend] = &&Label_Op_List_Extend,
+    [Op_Build_Dict] = &&Label_Op_Build_Dict,
+    [Op_Dict_Delete] = &&Label_Op_Dict_Delete,
+    [Op_Dict_Next] = &&Label_Op_Dict_Next,
+    [Op_Less_Equal] = &&Label_Op_Less_Equal,
+    [Op_Greater_Equal] = &&Label_Op_Greater_Equal,
+    [Op_Not_Equal] = &&Label_Op_Not_Equal,
+    [Op_Jump_If_False_Pop] = &&Label_Op_Jump_If_False_Pop,
+    [Op_Add_Local_Const] = &&Label_Op_Add_Local_Const,
+    [Op_Inc_Local_Const] = &&Label_Op_Inc_Local_Const,
+    [Op_Jump_If_Local_Ge_Const] = &&Label_Op_Jump_If_Local_Ge_Const,
+  };
+#endif
+
+  // every stream ends with Op_Return so there is no need to check ip against
+  // the end of the stream on every instruction
+  Vm_Loop() {
+    Vm_Case(Op_Add) {
+      if(Object_isStringLike(Peek(0)) && Object_isStringLike(Peek(1))) {
+        Store_Top();
+        concatenate_strings(env);
+        Load_Top();
+      }
+      else if(Value_isNumber(Peek(0)) && Value_isNumber(Peek(1))) {
+        value y = Pop();
+        value x = Pop();
+        double r = Value_asNumber(x) + Value_asNumber(y);
+        Push(Value_Number(r));
+      }
+      else {
+        Store_Top();
+        if(!array_arithmetic(env, inst)) return false;
+        Load_Top();
+      }
+    } Vm_Next();
+    Vm_Case(Op_Sub) {
+      if(!Value_isNumber(Peek(0)) ||
+        !Value_isNumber(Peek(1))) {
+        runtime_error(env, "%s: Operands must be numbers", opc_to_str[inst]);
+        return false; 
+      }
+      value y = Pop();
+      value x = Pop();
+      double r = Value_asNumber(x) - Value_asNumber(y);
+      Push(Value_Number(r));
+    } Vm_Next();
+    Vm_Case(Op_Mul) {
+      if(!Value_isNumber(Peek(0)) ||
+        !Value_isNumber(Peek(1))) {
+        Store_Top();
+        if(!array_arithmetic(env, inst)) return false;
+        Load_Top();
+        Vm_Next();
+      }
+      value y = Pop();
+      value x = Pop();
+      double r = Value_asNumber(x) * Value_asNumber(y);
+      Push(Value_Number(r));
+    } Vm_Next();
+    Vm_Case(Op_Div) {
+      if(!Value_isNumber(Peek(0)) ||
+        !Value_isNumber(Peek(1))) {
+        runtime_error(env, "%s: Operands must be numbers", opc_to_str[inst]);
+        return false; 
+      }
+      value y = Pop();
+      value x = Pop();
+      double r = Value_asNumber(x) / Value_asNumber(y);
+      Push(Value_Number(r));
+    } Vm_Next();
+    Vm_Case(Op_Less) {
+      if(!Value_isNumber(Peek(0)) || 
+        !Value_isNumber(Peek(1))) {
+        runtime_error(env, "Operands must be numbers");
+        return false; 
+      }
+      value y = Pop();
+      value x = Pop();
+      double r = Value_asNumber(x) < Value_asNumber(y);
+      Push(Value_Bool(r));
+    } Vm_Next();
+    Vm_Case(Op_Greater) {
+      if(!Value_isNumber(Peek(0)) || 
+        !Value_isNumber(Peek(1))) {
+        runtime_error(env, "Operands must be numbers");
+        return false; 
+      }
+      value y = Pop();
+      value x = Pop();
+      double r = Value_asNumber(x) > Value_asNumber(y);
+      Push(Value_Bool(r));
+    } Vm_Next();
+    Vm_Case(Op_Less_Equal) {
+      if(!Value_isNumber(Peek(0)) || 
+        !Value_isNumber(Peek(1))) {
+        runtime_error(env, "Operands must be numbers");
+        return false; 
+      }
+      value y = Pop();
+      value x = Pop();
+      // same result as the GREATER, NOT pair it replaces, also for NaN
+      double r = !(Value_asNumber(x) > Value_asNumber(y));
+      Push(Value_Bool(r));
+    } Vm_Next();
+    Vm_Case(Op_Greater_Equal) {
+      if(!Value_isNumber(Peek(0)) || 
+        !Value_isNumber(Peek(1))) {
+        runtime_error(env, "Operands must be numbers");
+        return false; 
+      }
+      value y = Pop();
+      value x = Pop();
+      double r = !(Value_asNumber(x) < Value_asNumber(y));
+      Push(Value_Bool(r));
+    } Vm_Next();
+    Vm_Case(Op_Not_Equal) {
+      value y = Pop();
+      value x = Pop();
+      Push(Value_Bool(!check_equality(env, x, y)));
+    } Vm_Next();
+    Vm_Case(Op_Equal) {
+      value y = Pop();
+      value x = Pop();
+      Push(Value_Bool(check_equality(env, x, y)));
+    } Vm_Next();
+    Vm_Case(Op_Neg) {
+      if(!Value_isNumber(Peek(0))) {
+        runtime_error(env, "%s: Operands must be numbers", opc_to_str[inst]);
+        return false;
+      }
+      value x = Pop();
+      Push(Value_Number(-Value_asNumber(x)));
+    } Vm_Next();
+    Vm_Case(Op_Not) {
+      value x = Pop();
+      Push(Value_Bool(is_falsey(x)));
+    } Vm_Next();
+    Vm_Case(Op_Push_Constant) {
+      value val = env->constants.data[Read_Byte()];
+      Push(val);
+    } Vm_Next();
+    Vm_Case(Op_Push_Constant_Long) {
+      value val = env->constants.data[Read_Long()];
+      Push(val);
+    } Vm_Next();
+    Vm_Case(Op_Build_List) {
+      i32 elem_count = Read_Short();
+      Store_Top();
+      build_list(env, elem_count);
+      Load_Top();
+    } Vm_Next();
+    Vm_Case(Op_List_Extend) {
+      i32 count = Read_Short();
+      if(!Object_isList(Peek(count))) {
+        runtime_error(env, "%s: Only lists can be extended", opc_to_str[inst]);
+        return false;
+      }
+      Store_Top();
+      extend_list(env, count);
+      Load_Top();
+    } Vm_Next();
+    Vm_Case(Op_List_Subscript) {
+      // lists first, they are what gets indexed the most
+      if(!Object_isList(Peek(1))) {
+        if(Object_isDict(Peek(1))) {
+          Store_Top();
+          if(!dict_get(env)) return false;
+          Load_Top();
+          Vm_Next();
         }
-        value y = eval_pop(env);
-        value x = eval_pop(env);
-        double r = Value_asNumber(x) < Value_asNumber(y);
-        eval_push(env, Value_Bool(r));
-        idx += 1;
-      } break;
-      case Op_Greater: {
-        if(!Value_isNumber(eval_peek(env, 0)) || 
-          !Value_isNumber(eval_peek(env, 1))) {
-          runtime_error(env, "Operands must be numbers");
-          return false; 
+        if(Object_isArray(Peek(1))) {
+          double* num = array_element(env, Peek(1), Peek(0));
+          if(num == NULL) return false;
+          sp -= 2;
+          Push(Value_Number(*num));
+          Vm_Next();
         }
-        value y = eval_pop(env);
-        value x = eval_pop(env);
-        double r = Value_asNumber(x) > Value_asNumber(y);
-        eval_push(env, Value_Bool(r));
-        idx += 1;
-      } break;
-      case Op_Equal: {
-        value y = eval_pop(env);
-        value x = eval_pop(env);
-        eval_push(env, Value_Bool(check_equality(x, y)));
-        idx += 1;
-      } break;
-      case Op_Neg: {
-        if(!Value_isNumber(eval_peek(env, 0))) {
-          runtime_error(env, "%s: Operands must be numbers", opc_to_str[inst]);
-          return false;
+      }
+      value* elem = list_element(env, Peek(1), Peek(0));
+      if(elem == NULL) return false;
+      sp -= 2;
+      Push(*elem);
+    } Vm_Next();
+    Vm_Case(Op_List_Store) {
+      if(!Object_isList(Peek(2))) {
+        if(Object_isDict(Peek(2))) {
+          Store_Top();
+          if(!dict_store(env)) return false;
+          Load_Top();
+          Vm_Next();
         }
-        value x = eval_pop(env);
-        eval_push(env, Value_Number(-Value_asNumber(x)));
-        idx += 1;
-      } break;
-      case Op_Not: {
-        eval_push(env, Value_Bool(is_falsey(eval_pop(env))));
-        idx += 1;
-      } break;
-      case Op_Push_Constant: {
-        value val = env->constants.data[ip[idx +1]];
-        eval_push(env, val);
-        idx += 2;
-      } break;
-      case Op_Build_List: {
-        i32 elem_count = (ip[idx +1] << 8) | ip[idx +2];
-        build_list(env, elem_count);
-        idx += 3;
-      } break;
-      case Op_List_Subscript: {
-        if(!Object_isList(eval_peek(env, 1)) && !Value_isNumber(eval_peek(env, 0))) {
-          runtime_error(env, "%s: Either Object is not subscriptable or Index is not a number", opc_to_str[inst], eval_peek(env, 0));
-          return false;
+        if(Object_isArray(Peek(2))) {
+          double* num = array_element(env, Peek(2), Peek(1));
+          if(num == NULL) return false;
+          if(!Value_isNumber(Peek(0))) {
+            runtime_error(env, "%s: Arrays only hold numbers", opc_to_str[inst]);
+            return false;
+          }
+          value val = Pop();
+          *num = Value_asNumber(val);
+          sp -= 2;
+          Push(val);
+          Vm_Next();
         }
-        value index = eval_pop(env);
-        value list = eval_pop(env);
-        value elem = Object_asList(list)->vector.data[(i32)(index.number)];
-        eval_push(env, elem);
-        idx += 1;
-      } break;
-      case Op_Define_Global: {
-        Object_String* name = Object_asString(env->constants.data[ip[idx +1]]);
-        table_set(&env->globals, name, eval_peek(env, 0));
-        eval_pop(env);
-        idx += 2;
-      } break;
-      case Op_Get_Global: {
-        Object_String* name = Object_asString(env->constants.data[ip[idx +1]]);
-        value val;
-        if(!table_get(&env->globals, name, &val)) {
-          runtime_error(env, "Undefined variable '%s'", name->str);
-          return false;
+      }
+      value* elem = list_element(env, Peek(2), Peek(1));
+      if(elem == NULL) return false;
+      value val = Pop();
+      value list = Peek(1);
+      *elem = val;
+      gc_write_barrier(env, Object_isSlice(list) ?
+        (Object*)Object_asSlice(list)->list : Value_asObject(list), val);
+      sp -= 2;
+      Push(val);
+    } Vm_Next();
+    Vm_Case(Op_List_Append) {
+      if(!Object_isList(Peek(1))) {
+        if(Object_isArray(Peek(1)) && Value_isNumber(Peek(0))) {
+          value val = Pop();
+          array_append(env, Object_asArray(Peek(0)), Value_asNumber(val));
+          sp -= 1;
+          Push(val);
+          Vm_Next();
         }
-        eval_push(env, val);
-        idx += 2;
-      } break;
-      case Op_Set_Global: {
-        Object_String* name = Object_asString(env->constants.data[ip[idx +1]]);
-
-        // table_set returns false if key is not new. which means this key
-        // never existed. so it is a runtime error because declaration is required
-        // before variable can be assigned
-        if(table_set(&env->globals, name, eval_peek(env, 0))) {
-          table_delete(&env->globals, name);
-          runtime_error(env, "Undefined variable '%s'", name->str);
+        runtime_error(env, "%s: Only lists and arrays of numbers can be appended to", opc_to_str[inst]);
+        return false;
+      }
+      value val = Pop();
+      list_append(env, Object_asList(Peek(0)), val);
+      sp -= 1;
+      Push(val);
+    } Vm_Next();
+    Vm_Case(Op_Build_Dict) {
+      i32 count = Read_Short();
+      Store_Top();
+      if(!build_dict(env, count)) return false;
+      Load_Top();
+    } Vm_Next();
+    Vm_Case(Op_Dict_Delete) {
+      if(!Object_isDict(Peek(1))) {
+        runtime_error(env, "%s: Only dictionaries can be deleted from", opc_to_str[inst]);
+        return false;
+      }
+      value key;
+      if(!dict_key(env, Peek(0), false, &key)) return false;
+      if(!Value_isUndefined(key))
+        table_delete(&Object_asDict(Peek(1))->table, key);
+      sp -= 2;
+    } Vm_Next();
+    // the loop keeps its key, the dictionary and the next slot to look at
+    // in three locals starting at the operand. pushes false once there are
+    // no keys left, a dictionary changed meanwhile may skip or repeat keys
+    Vm_Case(Op_Dict_Next) {
+      value* loop = &slots[Read_Byte()];
+      // the slot to look at is only off in a doctored image
+      if(!Object_isDict(loop[1]) || !Value_isNumber(loop[2]) ||
+        !(Value_asNumber(loop[2]) >= 0 && Value_asNumber(loop[2]) <= INT32_MAX)) {
+        runtime_error(env, "%s: Only dictionaries can be iterated over", opc_to_str[inst]);
+        return false;
+      }
+      Table* table = &Object_asDict(loop[1])->table;
+      i32 idx = table_next(table, (i32)Value_asNumber(loop[2]));
+      if(idx == -1)
+        Push(Value_Bool(false));
+      else {
+        loop[0] = table->entries[idx].key;
+        loop[2] = Value_Number(idx +1);
+        Push(Value_Bool(true));
+      }
+    } Vm_Next();
+    Vm_Case(Op_List_Slice) {
+      Store_Top();
+      if(!slice_list(env)) return false;
+      Load_Top();
+    } Vm_Next();
+    Vm_Case(Op_Define_Global_Slot) {
+      i32 slot = Read_Short();
+      globals[slot] = Peek(0);
+      Global_Barrier(slot, globals[slot]);
+      sp -= 1;
+    } Vm_Next();
+    Vm_Case(Op_Get_Global_Slot) {
+      i32 slot = Read_Short();
+      value val = globals[slot];
+      if(Value_isUndefined(val)) {
+        runtime_error(env, "Undefined variable '%s'",
+          Get_Object_CString(env->global_names.data[slot]));
+        return false;
+      }
+      Push(val);
+    } Vm_Next();
+    Vm_Case(Op_Set_Global_Slot) {
+      i32 slot = Read_Short();
+
+      // assignment never creates a global, declaration is required before a
+      // variable can be assigned
+      if(Value_isUndefined(globals[slot])) {
+        runtime_error(env, "Undefined variable '%s'",
+          Get_Object_CString(env->global_names.data[slot]));
+        return false;
+      }
+      globals[slot] = Peek(0);
+      Global_Barrier(slot, globals[slot]);
+    } Vm_Next();
+    Vm_Case(Op_Get_Local) {
+      uint8_t slot = Read_Byte();
+      Push(slots[slot]);
+    } Vm_Next();
+    Vm_Case(Op_Set_Local) {
+      uint8_t slot = Read_Byte();
+      slots[slot] = Peek(0);
+    } Vm_Next();
+    Vm_Case(Op_Jump_If_False) {
+      i32 offset = Read_Short();
+      if(is_falsey(Peek(0)))
+        ip += offset;
+    } Vm_Next();
+    Vm_Case(Op_Jump_If_False_Pop) {
+      i32 offset = Read_Short();
+      value cond = Pop();
+      if(is_falsey(cond))
+        ip += offset;
+    } Vm_Next();
+    Vm_Case(Op_Add_Local_Const) {
+      uint8_t slot = Read_Byte();
+      value k = env->constants.data[Read_Byte()];
+      if(Value_isNumber(slots[slot])) {
+        slots[slot] = Value_Number(Value_asNumber(slots[slot]) + Value_asNumber(k));
+        Vm_Next();
+      }
+      Store_Top();
+      if(!add_to_local(env, &slots[slot], k)) return false;
+      Load_Top();
+    } Vm_Next();
+    Vm_Case(Op_Inc_Local_Const) {
+      uint8_t slot = Read_Byte();
+      int8_t step = (int8_t)Read_Byte();
+      if(Value_isNumber(slots[slot])) {
+        slots[slot] = Value_Number(Value_asNumber(slots[slot]) + step);
+        Vm_Next();
+      }
+      Store_Top();
+      if(!add_to_local(env, &slots[slot], Value_Number(step))) return false;
+      Load_Top();
+    } Vm_Next();
+    Vm_Case(Op_Jump_If_Local_Ge_Const) {
+      uint8_t slot = Read_Byte();
+      value k = env->constants.data[Read_Byte()];
+      i32 offset = Read_Short();
+      if(!Value_isNumber(slots[slot]) || !Value_isNumber(k)) {
+        runtime_error(env, "Operands must be numbers");
+        return false;
+      }
+      // the LESS, JUMP_IF_FALSE_POP pair this replaces, NaN included
+      if(!(Value_asNumber(slots[slot]) < Value_asNumber(k)))
+        ip += offset;
+    } Vm_Next();
+    Vm_Case(Op_Jump) {
+      i32 offset = Read_Short();
+      ip += offset;
+    } Vm_Next();
+    Vm_Case(Op_Loop) {
+      i32 offset = Read_Short();
+      ip -= offset;
+    } Vm_Next();
+    Vm_Case(Op_True) {
+      Push(Value_Bool(true));
+    } Vm_Next();
+    Vm_Case(Op_False) {
+      Push(Value_Bool(false));
+    } Vm_Next();
+    Vm_Case(Op_Null) {
+      Push(Value_Null());
+    } Vm_Next();
+    Vm_Case(Op_Pop) {
+      sp -= 1;
+    } Vm_Next();
+    Vm_Case(Op_Print) {
+      print_value(Pop());
+      putc('\n', stdout);
+    } Vm_Next();
+    Vm_Case(Op_Call) {
+      i32 argc = Read_Byte();
+      value callee = Peek(argc);
+      if(Object_isNative(callee)) {
+        Object_Native* native = Object_asNative(callee);
+        if(native->arity != -1 && argc != native->arity) {
+          runtime_error(env, "'%s' expects %i arguments but got %i",
+            native->name->str, native->arity, argc);
           return false;
         }
-        idx += 2;
-      } break;
-      case Op_Get_Local: {
-        uint8_t slot = ip[idx +1];
-        eval_push(env, env->eval_stack.data[slot]);
-        idx += 2;
-      } break;
-      case Op_Set_Local: {
-        uint8_t slot = ip[idx +1];
-        env->eval_stack.data[slot] = eval_peek(env, 0);
-        idx += 2;
-      } break;
-      case Op_Jump_If_False: {
-        i32 offset = (ip[idx +1] << 8) | ip[idx +2];
-        idx += 3;
-        if(is_falsey(eval_peek(env, 0)))
-          idx += offset;
-      } break;
-      case Op_Jump: {
-        i32 offset = (ip[idx +1] << 8) | ip[idx +2];
-        idx += 3;
-        idx += offset;
-      } break;
-      case Op_Loop: {
-        i32 offset = (ip[idx +1] << 8) | ip[idx +2];
-        idx += 3;
-        idx -= offset;
-      } break;
-      case Op_True: {
-        eval_push(env, Value_Bool(true));
-        idx += 1;
-      } break;
-      case Op_False: {
-        eval_push(env, Value_Bool(false));
-        idx += 1;
-      } break;
-      case Op_Null: {
-        eval_push(env, Value_Null());
-        idx += 1;
-      } break;
-      case Op_Pop: {
-        eval_pop(env);
-        idx += 1;
-      } break;
-      case Op_Print: {
-        print_value(eval_pop(env));
-        putc('\n', stdout);
-        idx += 1;
-      } break;
-      case Op_Return: return true;
-      default:
-        fprintf(stderr, "Invalid Instruction Given\n");
+        Store_Top();
+        value result = native->fn(env, argc, sp - argc);
+        if(Value_isUndefined(result)) return false;
+        // the result replaces the native, same as Op_Return
+        sp -= argc +1;
+        Push(result);
+        Vm_Next();
+      }
+      if(!Object_isFunction(callee)) {
+        runtime_error(env, "Can only call procedures");
         return false;
-    }
+      }
+      Object_Function* fn = Object_asFunction(callee);
+      if(argc != fn->arity) {
+        runtime_error(env, "'%s' expects %i arguments but got %i",
+          fn->name->str, fn->arity, argc);
+        return false;
+      }
+      if(env->frame_count == Frames_Max) {
+        runtime_error(env, "Stack overflow, more than %i nested calls",
+          Frames_Max);
+        return false;
+      }
+
+      frame->ip = ip;
+      if(sp - env->stack + fn->code.count > env->stack_cap) {
+        Store_Top();
+        stack_reserve(env, fn->code.count);
+        Load_Top();
+      }
+      frame = &env->frames[env->frame_count];
+      env->frame_count += 1;
+      frame->function = fn;
+      frame->slots = sp - argc;
+      slots = frame->slots;
+      ip = fn->code.data;
+    } Vm_Next();
+    Vm_Case(Op_Return) {
+      if(env->frame_count == 1) {
+#ifdef COUNT_DISPATCH
+        print_dispatch_profile();
+#endif
+        Store_Top();
+        return true;
+      }
+      // the result replaces the callee, everything above it goes
+      value result = Pop();
+      sp = frame->slots -1;
+      Push(result);
+      env->frame_count -= 1;
+      frame = &env->frames[env->frame_count -1];
+      ip = frame->ip;
+      slots = frame->slots;
+    } Vm_Next();
+    Vm_Default()
+      fprintf(stderr, "Invalid Instruction Given\n");
+      return false;
   }
   return false; // just here to silent -Wreturn-type
 }
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
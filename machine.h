@@ -1,6 +1,7 @@
 #pragma once
 #include "vectors.h"
 #include "table.h"
+#include "gc.h"
 
 enum {
   Op_Error,         // placeholder to tell wrong opcode was present
@@ -20,9 +21,9 @@ enum {
   Op_Return,        // "
   Op_Print,
   Op_Pop,
-  Op_Define_Global,
-  Op_Set_Global,
-  Op_Get_Global,
+  Op_Define_Global_Slot,  // 3 bytes, 16 bit global slot
+  Op_Set_Global_Slot,     // "
+  Op_Get_Global_Slot,     // "
   Op_Set_Local,
   Op_Get_Local,
   Op_Jump_If_False,
@@ -30,20 +31,76 @@ enum {
   Op_Loop,
   Op_Build_List,
   Op_List_Subscript,
+  Op_Push_Constant_Long,  // 4 bytes, 24 bit constant index
+  Op_Call,                // 2 bytes, argument count
+  Op_List_Store,          // list[index] = value
+  Op_List_Append,         // list[] = value
+  Op_List_Slice,          // list[lo:hi], either bound may be null
+  Op_List_Extend,         // 3 bytes, appends that many values to the list below
+  Op_Build_Dict,          // 3 bytes, number of key value pairs
+  Op_Dict_Delete,         // delete dict[key]
+  Op_Dict_Next,           // 2 bytes, local slot of a for in loop's key
+
+  // fused instructions, only produced by optimize_bytecode()
+  Op_Less_Equal,          // <=
+  Op_Greater_Equal,       // >=
+  Op_Not_Equal,           // !=
+  Op_Jump_If_False_Pop,   // 3 bytes, pops the condition on both paths
+  Op_Add_Local_Const,     // 3 bytes, local slot and constant index
+  Op_Inc_Local_Const,     // 3 bytes, local slot and signed 8 bit step
+  Op_Jump_If_Local_Ge_Const, // 5 bytes, slot, constant index, 16 bit jump
 };
+// smallest evaluation stack handed out. interpret() grows the slab once
+// before running a frame if the code could need more (see stack_reserve)
+#define Stack_Min 256
+
+// One per procedure that is running, the script itself runs in frames[0].
+// slots is where the frame's locals start on the eval stack: the arguments
+// are its first locals and the procedure being called sits right below them,
+// so a call neither copies nor allocates anything
+typedef struct {
+  Object_Function* function;  // NULL for the script
+  byte* ip;                   // only up to date while another frame runs
+  value* slots;
+} Call_Frame;
+#ifndef Frames_Max
+  #define Frames_Max 256
+#endif
+
 typedef struct Env Env;
 struct Env {
   byte_vector stream;
   value_vector constants;
-  value_vector eval_stack;
+  value* stack;
+  value* stack_top;
+  i32 stack_cap;
   byte* ip;
-  Object* objects;
+  Call_Frame frames[Frames_Max];
+  i32 frame_count;
+  Object* objects;  // old generation, new objects start in gc.nursery
+  Gc gc;
+
   Table interned_strings;
+
+  // globals are resolved to dense slots at compile time. globals maps a
+  // name to its slot number, global_values/global_names are indexed by slot
   Table globals;
+  value_vector global_values;
+  value_vector global_names;
 };
 
 void env_allocate(Env* env);
+i32 global_slot(Env* env, Object_String* name);
+void define_native(Env* env, char* name, Native_Fn fn, i32 arity);
+void define_natives(Env* env);
+void runtime_error(Env* env, char* fmt, ...);
+bool dict_key(Env* env, value key, bool add, value* result);
 void env_print_instructions(Env* env);
+i32 opcode_length(byte inst);
+bool opcode_valid(byte inst);
+i32 optimize_bytecode(Env* env);
 bool interpret(Env* env);
 void env_deallocate(Env* env);
 void print_value(value data);
+bool is_falsey(value val);
+bool check_equality(Env* env, value x, value y);
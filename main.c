@@ -1,50 +1,108 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "common.h"
 #include "vectors.h"
 #include "machine.h"
+#include "image.h"
 
 // from parser.c can't be bother to make a whole new file for this
 bool parse_and_gen_bytecode(Env* env, char* src);
 
-char* load_file(char* file_name) {
-  FILE* fptr = fopen(file_name, "r");
-  if(fptr == NULL) {
+// maps the file read only instead of copying it. the lexer wants a 0 after
+// the last byte, so the file is mapped over an anonymous mapping one byte
+// longer: the rest of the file's last page reads as 0, and if the file
+// fills that page exactly the extra byte is on the anonymous page behind it
+char* map_file(char* file_name, size_t* len) {
+  int fd = open(file_name, O_RDONLY);
+  struct stat info;
+  if(fd < 0 || fstat(fd, &info) < 0) {
     fprintf(stderr, "ERROR: %s: %s\n", file_name, strerror(errno));
     exit(1);
   }
 
-  fseek(fptr, 0, SEEK_END);
-  i32 size = ftell(fptr);
-  fseek(fptr, 0, SEEK_SET);
-
-  char* dst_buf = ALLOCATE(char, size +1);
-  fread(dst_buf, 1, size, fptr);
-  dst_buf[size] = '\0';
-  fclose(fptr);
-  return dst_buf;
+  size_t size = info.st_size;
+  char* base = mmap(NULL, size +1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(base == MAP_FAILED || (size > 0 &&
+    mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+    fprintf(stderr, "ERROR: %s: %s\n", file_name, strerror(errno));
+    exit(1);
+  }
+  close(fd);
+  *len = size;
+  return base;
 }
 
 i32 main(i32 argc, char** argv) {
+  // PLAY_MEMPROF=1 prints a memory profile at exit, kill -USR1 prints one
+  // while running
+  char* memprof = getenv("PLAY_MEMPROF");
+  if(memprof != NULL && atoi(memprof) != 0)
+    x_alloc_profile_start();
+
+  // ./play --compile out.chc src-file writes an image instead of running,
+  // ./play file runs either a script or an image
+  char* image_path = NULL;
   char* src = NULL;
+  size_t src_len = 0;
   if(argc == 2) {
-    src = load_file(argv[1]);
+    src = map_file(argv[1], &src_len);
+  }
+  else if(argc == 4 && strcmp(argv[1], "--compile") == 0) {
+    image_path = argv[2];
+    src = map_file(argv[3], &src_len);
   }
   else {
-    fprintf(stderr, "Usage: ./play src-file\n");
+    fprintf(stderr, "Usage: ./play src-file\n"
+                    "       ./play image.chc\n"
+                    "       ./play --compile out.chc src-file\n");
     return 1;
   }
 
   Env env;
   env_allocate(&env);
 
-  bool ok = parse_and_gen_bytecode(&env, src);
-  if(ok) {
+  // collector tuning for long running scripts, see gc.h
+  char* min_heap = getenv("PLAY_GC_MIN_HEAP");
+  if(min_heap != NULL)
+    env.gc.min_heap = env.gc.next_gc = strtoull(min_heap, NULL, 10);
+  char* growth = getenv("PLAY_GC_GROWTH");
+  if(growth != NULL && strtod(growth, NULL) > 1.0)
+    env.gc.grow_factor = strtod(growth, NULL);
+  char* nursery = getenv("PLAY_GC_NURSERY");
+  if(nursery != NULL)
+    env.gc.nursery_size = strtoull(nursery, NULL, 10);
+  char* step = getenv("PLAY_GC_STEP");
+  if(step != NULL)
+    env.gc.step_budget = atoi(step);
+  define_natives(&env);
+
+  // an image was optimized when it was written
+  bool ok;
+  if(image_is_image(src, src_len))
+    ok = image_load(&env, src, src_len);
+  else if((ok = parse_and_gen_bytecode(&env, src))) {
+    // PLAY_PEEPHOLE=1 reports what the optimizer did
+    i32 removed = optimize_bytecode(&env);
+    char* peephole = getenv("PLAY_PEEPHOLE");
+    if(peephole != NULL && atoi(peephole) != 0)
+      fprintf(stderr, "Peephole: removed %i instructions\n", removed);
+  }
+
+  if(ok && image_path != NULL)
+    ok = image_write(&env, image_path);
+  else if(ok) {
     env_print_instructions(&env);
-    bool iok = interpret(&env);
-    if(!iok) {
-      fprintf(stderr, "Interpeter Error.. Aborting\n");
-    }
+    ok = interpret(&env);
+    if(!ok)
+      fprintf(stderr, "Interpreter Error.. Aborting\n");
   }
+  if(x_alloc_profiling)
+    x_alloc_print_profile();
+
+  // strings loaded from an image still point into the mapping
   env_deallocate(&env);
-  free(src);
-  return 0;
+  munmap(src, src_len +1);
+  return ok ? 0 : 1;
 }
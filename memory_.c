@@ -1,29 +1,317 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
 #include "memory_.h"
 
+// Size class pool allocator behind x_alloc.
+//
+// Requests up to Pool_Max_Size bytes are rounded up to a multiple of
+// Pool_Granularity and served from a free list per size class. the free
+// lists are refilled by carving blocks off Pool_Chunk_Size chunks, which
+// are only given back to the system by x_alloc_release(). anything bigger
+// goes to malloc. every block starts with a Block_Header so FREE/REALLOCATE
+// know where a pointer came from.
+//
+// build with -DPOOL_DISABLED to send everything to malloc (useful together
+// with the address sanitizer).
+//
+// The memory profiler is switched on at runtime by x_alloc_profile_start().
+// it keeps allocation counts, live and peak bytes per call site (the
+// file/line of the ALLOCATE/REALLOCATE) and per object kind, the latter is
+// reported by object.c through x_alloc_profile_kind(). when it is off the
+// only cost is a branch per allocation. x_alloc_print_profile() writes a
+// report sorted by peak bytes, SIGUSR1 asks for one at the next allocation.
+
+#define Pool_Granularity 16
+#define Pool_Max_Size    256
+#define Pool_Class_Count (Pool_Max_Size / Pool_Granularity)
+#define Pool_Chunk_Size  (64 * 1024)
+#define Large_Class      Pool_Class_Count
+
+// 16 bytes so the payload keeps malloc's alignment
+typedef struct {
+  uint32_t size_class;
+  uint32_t site;     // index into alloc_sites, 0 if not profiled
+  size_t size;       // bytes asked for
+} Block_Header;
+
+typedef struct Free_Block {
+  struct Free_Block* next;
+} Free_Block;
+
+typedef struct Chunk {
+  struct Chunk* next;
+} Chunk;
+
+typedef struct {
+  size_t allocs, frees, live, peak_live;
+} Class_Stats;
+
+static Free_Block* free_lists[Pool_Class_Count];
+static Chunk* chunks = NULL;
+static char* chunk_top = NULL;   // bump pointer in the newest chunk
+static char* chunk_end = NULL;
+// one more for the blocks that went to malloc
+static Class_Stats class_stats[Pool_Class_Count +1];
+
+bool x_alloc_profiling = false;
+static volatile sig_atomic_t profile_requested = 0;
+
+typedef struct {
+  const char* name;  // file for call sites, kind name for objects
+  int line;
+  size_t allocs, frees, bytes, live, peak;
+} Alloc_Site;
+
+// slot 0 collects blocks allocated before profiling started and whatever
+// doesn't fit once the table is full
+#define Site_Cap 1024
+static Alloc_Site alloc_sites[Site_Cap];
+static uint32_t site_count = 1;
+
+#define Kind_Cap 16
+static Alloc_Site kind_stats[Kind_Cap];
+
+// file names come from __FILE__ so the pointer is good enough as key
+static uint32_t find_site(const char* file, int line) {
+  uint32_t idx = (((uintptr_t)file >> 4) * 31 + line) & (Site_Cap -1);
+  for(;;) {
+    Alloc_Site* site = &alloc_sites[idx];
+    if(idx != 0) {
+      if(site->name == file && site->line == line) return idx;
+      if(site->name == NULL) {
+        if(site_count == Site_Cap -1) return 0;
+        site->name = file;
+        site->line = line;
+        site_count += 1;
+        return idx;
+      }
+    }
+    idx = (idx +1) & (Site_Cap -1);
+  }
+}
+
+static void site_add(Alloc_Site* site, size_t bytes) {
+  site->allocs += 1;
+  site->bytes += bytes;
+  site->live += bytes;
+  if(site->live > site->peak) site->peak = site->live;
+}
+
+static void site_remove(Alloc_Site* site, size_t bytes) {
+  site->frees += 1;
+  site->live -= bytes < site->live ? bytes : site->live;
+}
+
+// a block changing size in place, not counted as an allocation
+static void site_resize(Alloc_Site* site, size_t old_size, size_t new_size) {
+  site->live -= old_size < site->live ? old_size : site->live;
+  site->live += new_size;
+  if(site->live > site->peak) site->peak = site->live;
+}
+
+static void on_profile_signal(int sig) {
+  (void)sig;
+  profile_requested = 1;
+}
+
+static uint32_t size_class_of(size_t size) {
+  if(size == 0) return 0;
+  if(size > Pool_Max_Size) return Large_Class;
+  return (size + Pool_Granularity -1) / Pool_Granularity -1;
+}
+
+static size_t class_size(uint32_t size_class) {
+  return (size_class +1) * Pool_Granularity;
+}
+
+static void* out_of_memory(void) {
+  fprintf(stderr, "Out of Memory.. Aborting\n");
+  exit(1);
+  return NULL;
+}
+
+static Block_Header* pool_take(uint32_t size_class) {
+  Free_Block* block = free_lists[size_class];
+  if(block != NULL) {
+    free_lists[size_class] = block->next;
+    return (Block_Header*)block;
+  }
+
+  size_t size = sizeof(Block_Header) + class_size(size_class);
+  if(chunk_top == NULL || (size_t)(chunk_end - chunk_top) < size) {
+    Chunk* chunk = malloc(Pool_Chunk_Size);
+    if(chunk == NULL) return out_of_memory();
+    chunk->next = chunks;
+    chunks = chunk;
+    // keep the first block 16 byte aligned
+    chunk_top = (char*)chunk + Pool_Granularity;
+    chunk_end = (char*)chunk + Pool_Chunk_Size;
+  }
+  Block_Header* header = (Block_Header*)chunk_top;
+  chunk_top += size;
+  return header;
+}
+
+static void* block_allocate(size_t size, const char* file, int line) {
+  uint32_t size_class = size_class_of(size);
+#ifdef POOL_DISABLED
+  size_class = Large_Class;
+#endif
+  Block_Header* header;
+  if(size_class == Large_Class) {
+    header = malloc(sizeof(Block_Header) + size);
+    if(header == NULL) return out_of_memory();
+  }
+  else header = pool_take(size_class);
+
+  header->size_class = size_class;
+  header->size = size;
+
+  Class_Stats* stats = &class_stats[size_class];
+  stats->allocs += 1;
+  stats->live += 1;
+  if(stats->live > stats->peak_live) stats->peak_live = stats->live;
+  header->site = 0;
+  if(x_alloc_profiling) {
+    header->site = find_site(file, line);
+    site_add(&alloc_sites[header->site], size);
+    if(profile_requested) {
+      profile_requested = 0;
+      x_alloc_print_profile();
+    }
+  }
+  return header +1;
+}
+
+static void block_free(void* ptr) {
+  Block_Header* header = (Block_Header*)ptr -1;
+  uint32_t size_class = header->size_class;
+  Class_Stats* stats = &class_stats[size_class];
+  stats->frees += 1;
+  stats->live -= 1;
+  if(header->site != 0)
+    site_remove(&alloc_sites[header->site], header->size);
+
+  if(size_class == Large_Class) {
+    free(header);
+    return;
+  }
+  // the link overwrites the header
+  Free_Block* block = (Free_Block*)header;
+  block->next = free_lists[size_class];
+  free_lists[size_class] = block;
+}
+
 void* x_alloc(void* old_ptr, size_t elem_size, int count,
   const char* file, int line) {
-  (void)line;
-  (void)file;
   if(old_ptr != NULL && count == 0) {
-    // printf("%-10s:%i: Free_Request: [%p]\n", file, line, old_ptr);
-    free(old_ptr);
+    block_free(old_ptr);
     return NULL;
   }
-  if(count != 0) {
-    // if(old_ptr == NULL)
-    //   printf("%s:%i: Alloc_Request: [%zu * %i]\n", file, line, elem_size,
-    //     count);
-    // else
-    //   printf("%s:%i: Realloc_Request: [%zu * %i]\n", file, line, elem_size,
-    //     count);
-
-    void* new_ptr = realloc(old_ptr, elem_size * count);
-    if(new_ptr == NULL) {
-      fprintf(stderr, "Out of Memory.. Aborting\n");
-      exit(1);
-    }
-    return new_ptr;
+  if(count == 0)
+    return NULL;
+
+  size_t size = elem_size * count;
+  if(old_ptr == NULL)
+    return block_allocate(size, file, line);
+
+  Block_Header* header = (Block_Header*)old_ptr -1;
+  if(header->size_class == Large_Class && size_class_of(size) == Large_Class) {
+    header = realloc(header, sizeof(Block_Header) + size);
+    if(header == NULL) return out_of_memory();
+    if(header->site != 0)
+      site_resize(&alloc_sites[header->site], header->size, size);
+    header->size = size;
+    return header +1;
+  }
+  // still fits the block it already has
+  if(header->size_class != Large_Class && size <= class_size(header->size_class)) {
+    if(header->site != 0)
+      site_resize(&alloc_sites[header->site], header->size, size);
+    header->size = size;
+    return old_ptr;
+  }
+
+  void* new_ptr = block_allocate(size, file, line);
+  memcpy(new_ptr, old_ptr, header->size < size ? header->size : size);
+  block_free(old_ptr);
+  return new_ptr;
+}
+
+// gives every chunk back at once. pooled blocks still in use become
+// invalid, so only call it once nothing allocated through x_alloc is left
+void x_alloc_release(void) {
+  Chunk* chunk = chunks;
+  while(chunk != NULL) {
+    Chunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  chunks = NULL;
+  chunk_top = chunk_end = NULL;
+  for(int x = 0; x < Pool_Class_Count; x+=1)
+    free_lists[x] = NULL;
+}
+
+void x_alloc_profile_start(void) {
+  x_alloc_profiling = true;
+  signal(SIGUSR1, on_profile_signal);
+}
+
+// bytes > 0 for a new object of the kind, < 0 when one is freed
+void x_alloc_profile_kind(int kind, const char* name, long bytes) {
+  if(kind < 0 || kind >= Kind_Cap) return;
+  Alloc_Site* stats = &kind_stats[kind];
+  stats->name = name;
+  if(bytes >= 0) site_add(stats, bytes);
+  else site_remove(stats, -bytes);
+}
+
+static int by_peak(const void* a, const void* b) {
+  const Alloc_Site* x = *(const Alloc_Site**)a;
+  const Alloc_Site* y = *(const Alloc_Site**)b;
+  if(x->peak != y->peak) return x->peak < y->peak ? 1 : -1;
+  return x->allocs < y->allocs ? 1 : x->allocs > y->allocs ? -1 : 0;
+}
+
+static void print_sites(const char* title, Alloc_Site* sites, int count,
+  bool with_line) {
+  Alloc_Site* sorted[Site_Cap];
+  int used = 0;
+  for(int x = 0; x < count; x+=1)
+    if(sites[x].allocs != 0) sorted[used++] = &sites[x];
+  qsort(sorted, used, sizeof(Alloc_Site*), by_peak);
+
+  fprintf(stderr, "%-24s %10s %10s %12s %12s %12s\n", title, "allocs",
+    "frees", "bytes", "live", "peak");
+  for(int x = 0; x < used; x+=1) {
+    Alloc_Site* site = sorted[x];
+    char name[64];
+    if(site->name == NULL) snprintf(name, sizeof(name), "(untracked)");
+    else if(with_line) snprintf(name, sizeof(name), "%s:%i", site->name, site->line);
+    else snprintf(name, sizeof(name), "%s", site->name);
+    fprintf(stderr, "%-24s %10zu %10zu %12zu %12zu %12zu\n", name,
+      site->allocs, site->frees, site->bytes, site->live, site->peak);
+  }
+}
+
+void x_alloc_print_profile(void) {
+  fprintf(stderr, "=== Memory Profile ===\n");
+  fprintf(stderr, "%-10s %10s %10s %10s %10s\n", "class", "allocs", "frees",
+    "live", "peak");
+  for(int x = 0; x <= Pool_Class_Count; x+=1) {
+    Class_Stats* stats = &class_stats[x];
+    if(stats->allocs == 0) continue;
+    char name[16];
+    if(x == Large_Class) snprintf(name, sizeof(name), ">%i", Pool_Max_Size);
+    else snprintf(name, sizeof(name), "%zu", class_size(x));
+    fprintf(stderr, "%-10s %10zu %10zu %10zu %10zu\n", name, stats->allocs,
+      stats->frees, stats->live, stats->peak_live);
   }
-  return NULL; // just here to silent -Wreturn-type
-}
\ No newline at end of file
+  fprintf(stderr, "\n");
+  print_sites("site", alloc_sites, Site_Cap, true);
+  fprintf(stderr, "\n");
+  print_sites("object kind", kind_stats, Kind_Cap, false);
+  fprintf(stderr, "=== End Memory Profile ===\n");
+}
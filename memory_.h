@@ -1,8 +1,16 @@
 #pragma once
 #include "stdlib.h"
 #include "string.h"
+#include "stdbool.h"
 
 void* x_alloc(void* old_ptr, size_t elem_size, int count, const char* file, int line);
 #define ALLOCATE(type, count) (type*)x_alloc(NULL, sizeof(type), count, __FILE__, __LINE__)
 #define REALLOCATE(type, old_ptr, count) (type*)x_alloc(old_ptr, sizeof(type), count, __FILE__, __LINE__)
-#define FREE(old_ptr) x_alloc(old_ptr, 0, 0, __FILE__, __LINE__)
\ No newline at end of file
+#define FREE(old_ptr) x_alloc(old_ptr, 0, 0, __FILE__, __LINE__)
+void x_alloc_release(void);
+
+// opt-in memory profiler, see memory_.c
+extern bool x_alloc_profiling;
+void x_alloc_profile_start(void);
+void x_alloc_profile_kind(int kind, const char* name, long bytes);
+void x_alloc_print_profile(void);
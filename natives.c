@@ -0,0 +1,187 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include "object.h"
+#include "machine.h"
+#include "array.h"
+
+// Procedures implemented in C, see Object_Native for the calling convention.
+// define_natives() binds all of them to globals when the machine starts.
+
+// seconds of processor time since the program started
+static value native_clock(Env* env, i32 argc, value* args) {
+  (void)env; (void)argc; (void)args;
+  return Value_Number((double)clock() / CLOCKS_PER_SEC);
+}
+
+static value native_sqrt(Env* env, i32 argc, value* args) {
+  (void)argc;
+  if(!Value_isNumber(args[0])) {
+    runtime_error(env, "sqrt: Operand must be a number");
+    return Value_Undefined();
+  }
+  return Value_Number(sqrt(Value_asNumber(args[0])));
+}
+
+// element count of a list, slice or array, character count of a string,
+// key count of a dictionary
+static value native_len(Env* env, i32 argc, value* args) {
+  (void)argc;
+  if(Object_isDict(args[0]))
+    return Value_Number(Object_asDict(args[0])->table.count);
+  if(Object_isArray(args[0]))
+    return Value_Number(Object_asArray(args[0])->vector.count);
+  if(Object_isListLike(args[0])) {
+    i32 count;
+    list_values(args[0], &count);
+    return Value_Number(count);
+  }
+  if(Object_isStringLike(args[0]))
+    return Value_Number(string_length(Value_asObject(args[0])));
+  runtime_error(env, "len: Operand must be a list, a slice, an array, a dictionary or a string");
+  return Value_Undefined();
+}
+
+// appends in place and returns the list or array
+static value native_append(Env* env, i32 argc, value* args) {
+  (void)argc;
+  if(Object_isArray(args[0]) && Value_isNumber(args[1])) {
+    array_append(env, Object_asArray(args[0]), Value_asNumber(args[1]));
+    return args[0];
+  }
+  if(!Object_isList(args[0])) {
+    runtime_error(env, "append: First operand must be a list or an array of numbers");
+    return Value_Undefined();
+  }
+  list_append(env, Object_asList(args[0]), args[1]);
+  return args[0];
+}
+
+// array(n) is n zeros, array(list) the numbers of a list or slice and
+// array(array) a copy
+static value native_array(Env* env, i32 argc, value* args) {
+  (void)argc;
+  if(Value_isNumber(args[0])) {
+    double count = Value_asNumber(args[0]);
+    if(!(count >= 0 && count <= INT32_MAX)) {
+      runtime_error(env, "array: Can't make an array of %g elements", count);
+      return Value_Undefined();
+    }
+    Object_Array* array = allocate_array(env, (i32)count);
+    for(i32 x = 0; x < array->vector.count; x+=1)
+      array->vector.data[x] = 0;
+    return Value_Object(array);
+  }
+  if(Object_isArray(args[0])) {
+    i32 count = Object_asArray(args[0])->vector.count;
+    Object_Array* array = allocate_array(env, count);
+    if(count > 0)
+      memcpy(array->vector.data, Object_asArray(args[0])->vector.data,
+        sizeof(double) * count);
+    return Value_Object(array);
+  }
+  if(!Object_isListLike(args[0])) {
+    runtime_error(env, "array: Operand must be a number, a list, a slice or an array");
+    return Value_Undefined();
+  }
+  i32 count;
+  value* values = list_values(args[0], &count);
+  for(i32 x = 0; x < count; x+=1) {
+    if(!Value_isNumber(values[x])) {
+      runtime_error(env, "array: Element %i is not a number", x);
+      return Value_Undefined();
+    }
+  }
+  Object_Array* array = allocate_array(env, count);
+  for(i32 x = 0; x < count; x+=1)
+    array->vector.data[x] = Value_asNumber(values[x]);
+  return Value_Object(array);
+}
+
+static Object_Array* array_operand(Env* env, value val, const char* native) {
+  if(!Object_isArray(val)) {
+    runtime_error(env, "%s: Operand must be an array", native);
+    return NULL;
+  }
+  return Object_asArray(val);
+}
+
+static value native_sum(Env* env, i32 argc, value* args) {
+  (void)argc;
+  Object_Array* array = array_operand(env, args[0], "sum");
+  if(array == NULL) return Value_Undefined();
+  return Value_Number(array_sum(array->vector.data, array->vector.count));
+}
+
+// min and max of an empty array are null
+static value native_min(Env* env, i32 argc, value* args) {
+  (void)argc;
+  Object_Array* array = array_operand(env, args[0], "min");
+  if(array == NULL) return Value_Undefined();
+  if(array->vector.count == 0) return Value_Null();
+  return Value_Number(array_min(array->vector.data, array->vector.count));
+}
+
+static value native_max(Env* env, i32 argc, value* args) {
+  (void)argc;
+  Object_Array* array = array_operand(env, args[0], "max");
+  if(array == NULL) return Value_Undefined();
+  if(array->vector.count == 0) return Value_Null();
+  return Value_Number(array_max(array->vector.data, array->vector.count));
+}
+
+typedef i32 (*Filter_Fn)(double* dst, double* x, double k, i32 count);
+
+// a new array with the elements passing filter, the result is sized for all
+// of them and keeps the spare capacity
+static value filter_array(Env* env, value* args, Filter_Fn filter,
+  const char* native) {
+  Object_Array* array = array_operand(env, args[0], native);
+  if(array == NULL) return Value_Undefined();
+  if(!Value_isNumber(args[1])) {
+    runtime_error(env, "%s: Bound must be a number", native);
+    return Value_Undefined();
+  }
+  Object_Array* result = allocate_array(env, array->vector.count);
+  result->vector.count = filter(result->vector.data, array->vector.data,
+    Value_asNumber(args[1]), array->vector.count);
+  return Value_Object(result);
+}
+
+static value native_filter_less(Env* env, i32 argc, value* args) {
+  (void)argc;
+  return filter_array(env, args, array_filter_less, "filter_less");
+}
+
+static value native_filter_greater(Env* env, i32 argc, value* args) {
+  (void)argc;
+  return filter_array(env, args, array_filter_greater, "filter_greater");
+}
+
+// whether dict has key, the only way to ask without an error for a key
+// that isn't there
+static value native_has(Env* env, i32 argc, value* args) {
+  (void)argc;
+  if(!Object_isDict(args[0])) {
+    runtime_error(env, "has: First operand must be a dictionary");
+    return Value_Undefined();
+  }
+  value key, val;
+  if(!dict_key(env, args[1], false, &key)) return Value_Undefined();
+  return Value_Bool(!Value_isUndefined(key) &&
+    table_get(&Object_asDict(args[0])->table, key, &val));
+}
+
+void define_natives(Env* env) {
+  define_native(env, "clock", native_clock, 0);
+  define_native(env, "sqrt", native_sqrt, 1);
+  define_native(env, "len", native_len, 1);
+  define_native(env, "append", native_append, 2);
+  define_native(env, "array", native_array, 1);
+  define_native(env, "sum", native_sum, 1);
+  define_native(env, "min", native_min, 1);
+  define_native(env, "max", native_max, 1);
+  define_native(env, "filter_less", native_filter_less, 2);
+  define_native(env, "filter_greater", native_filter_greater, 2);
+  define_native(env, "has", native_has, 2);
+}
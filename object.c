@@ -6,41 +6,87 @@
 #include "value.h"
 #include "machine.h"
 #include "table.h"
+#include "gc.h"
+
+static const char* object_kind_name[] = {
+  [Ok_String]   = "Ok_String",
+  [Ok_List]     = "Ok_List",
+  [Ok_Function] = "Ok_Function",
+  [Ok_Rope]     = "Ok_Rope",
+  [Ok_Native]   = "Ok_Native",
+  [Ok_Slice]    = "Ok_Slice",
+  [Ok_Array]    = "Ok_Array",
+  [Ok_Dict]     = "Ok_Dict",
+};
+
+// the object structs themselves, whatever they point to is counted at the
+// call site that allocated it
+static const size_t object_kind_size[] = {
+  [Ok_String]   = sizeof(Object_String),
+  [Ok_List]     = sizeof(Object_List),
+  [Ok_Function] = sizeof(Object_Function),
+  [Ok_Rope]     = sizeof(Object_Rope),
+  [Ok_Native]   = sizeof(Object_Native),
+  [Ok_Slice]    = sizeof(Object_Slice),
+  [Ok_Array]    = sizeof(Object_Array),
+  [Ok_Dict]     = sizeof(Object_Dict),
+};
 
 Object* allocate_object(Env* env, size_t size, Object_Kind kind) {
-  Object* ob = ALLOCATE(Object, size);
+  gc_maybe_collect(env);
+  gc_account(env, size);
+
+  Object* ob = (Object*)ALLOCATE(byte, size);
   ob->kind = kind;
-  ob->next = env->objects;
-  env->objects = ob;
+  ob->is_marked = false;
+  ob->is_old = false;
+  ob->is_remembered = false;
+  ob->next = env->gc.nursery;
+  env->gc.nursery = ob;
+
+  if(x_alloc_profiling)
+    x_alloc_profile_kind(kind, object_kind_name[kind], size);
   return ob;
 }
 
+// frees only what the object itself owns, objects it refers to are on one
+// of the collector's lists as well and are freed on their own
 void free_object(Object* object) {
   switch(object->kind) {
     case Ok_String: {
       Object_String* str = (Object_String*)object;
-      FREE(str->str);
-      FREE(object);
+      if(!str->is_borrowed)
+        FREE(str->str);
     } break;
     case Ok_List: {
       Object_List* list = (Object_List*)object;
-      for(i32 x=0; x<list->vector.count; x+=1) {
-        value v = list->vector.data[x];
-        if(Value_isObject(v))
-          free_object(Value_asObject(v));
-      }
       value_vector_deallocate(&list->vector);
     } break;
     case Ok_Function: {
       Object_Function* fn = (Object_Function*)object;
-      free_object((Object*)fn->name);
       byte_vector_deallocate(&fn->code);
     } break;
+    case Ok_Rope: {
+      Object_Rope* rope = (Object_Rope*)object;
+      FREE(rope->str);
+    } break;
+    case Ok_Native: break;
+    case Ok_Slice: break;
+    case Ok_Array: {
+      Object_Array* array = (Object_Array*)object;
+      double_vector_deallocate(&array->vector);
+    } break;
+    case Ok_Dict:
+      table_deallocate(&((Object_Dict*)object)->table);
+      break;
   }
+  if(x_alloc_profiling)
+    x_alloc_profile_kind(object->kind, object_kind_name[object->kind],
+      -(long)object_kind_size[object->kind]);
+  FREE(object);
 }
 
-void free_objects(Env* env) {
-  Object* ob = env->objects;
+static void free_object_list(Object* ob) {
   while(ob != NULL) {
     Object* next = ob->next;
     free_object(ob);
@@ -48,32 +94,80 @@ void free_objects(Env* env) {
   }
 }
 
+void free_objects(Env* env) {
+  free_object_list(env->objects);
+  free_object_list(env->gc.nursery);
+  free_object_list(env->gc.sweeping);
+  env->objects = env->gc.nursery = env->gc.sweeping = NULL;
+}
+
+static Object_String* intern_new_string(Env* env, char* str, int len,
+  uint32_t hash, bool is_borrowed) {
+  Object_String* string = (Object_String*)allocate_object(env, 
+    sizeof(Object_String),
+    Ok_String);
+  if(!is_borrowed)
+    gc_account(env, len +1);
+  string->str = str;
+  string->len = len;
+  string->hash = hash;
+  string->is_interned = true;
+  string->has_hash = true;
+  string->is_borrowed = is_borrowed;
+  table_set(&env->interned_strings, Value_Object(string), Value_Null());
+  return string;
+}
+
 Object_String* allocate_string(Env* env, char* str, int len, uint32_t hash) {
   Object_String* interned = table_find_string(&env->interned_strings, str, len,
     hash);
   if(interned != NULL) {
     // don't care about the string if it already there..
-    free(str);
+    FREE(str);
     return interned;
   }
-  
-  Object_String* string = (Object_String*)allocate_object(env, 
-    sizeof(Object_String),
-    Ok_String);
+  return intern_new_string(env, str, len, hash, false);
+}
+
+// interns str without copying or owning it, for strings in a mapped image.
+// str has to be 0 terminated and stay around as long as env does
+Object_String* borrow_string(Env* env, char* str, int len, uint32_t hash) {
+  Object_String* interned = table_find_string(&env->interned_strings, str, len,
+    hash);
+  if(interned != NULL) return interned;
+  return intern_new_string(env, str, len, hash, true);
+}
+
+// takes ownership of str without hashing or interning it, for strings
+// produced while running
+Object_String* take_runtime_string(Env* env, char* str, int len) {
+  Object_String* string = (Object_String*)allocate_object(env,
+    sizeof(Object_String), Ok_String);
+  gc_account(env, len +1);
   string->str = str;
   string->len = len;
-  string->hash = hash;
-  table_set(&env->interned_strings, string, Value_Null());
+  string->hash = 0;
+  string->is_interned = false;
+  string->has_hash = false;
+  string->is_borrowed = false;
   return string;
 }
 
+uint32_t string_hash(Object_String* str) {
+  if(!str->has_hash) {
+    str->hash = String_Hash(str->str, str->len);
+    str->has_hash = true;
+  }
+  return str->hash;
+}
+
 Object_String* take_string(Env* env, char* str, int len) {
-  uint32_t hash = fnv_1a(str, len);
+  uint32_t hash = String_Hash(str, len);
   return allocate_string(env, str, len, hash);
 }
 
 Object_String* object_string_cpy(Env* env, char* str, int len) {
-  uint32_t hash = fnv_1a(str, len);
+  uint32_t hash = String_Hash(str, len);
 
   char* heap_str = ALLOCATE(char, len+1);
   memcpy(heap_str, str, len);
@@ -87,6 +181,175 @@ Object_List* allocate_list(Env* env) {
   return list;
 }
 
+// room for exactly cap values, for callers that know the size up front. an
+// empty list gets the usual capacity so appending can double it
+Object_List* allocate_list_cap(Env* env, i32 cap) {
+  if(cap == 0) return allocate_list(env);
+  Object_List* list = (Object_List*)allocate_object(env, sizeof(Object_List), Ok_List);
+  list->vector.data = ALLOCATE(value, cap);
+  list->vector.count = 0;
+  list->vector.cap = cap;
+  return list;
+}
+
+// the vector doubles when full, so appending is amortized O(1)
+void list_append(Env* env, Object_List* list, value val) {
+  i32 old_cap = list->vector.cap;
+  value_vector_pushback(&list->vector, val);
+  gc_write_barrier(env, (Object*)list, val);
+  if(list->vector.cap != old_cap)
+    gc_account(env, sizeof(value) * (list->vector.cap - old_cap));
+}
+
+// start is relative to list, which must not be a slice itself
+Object_Slice* allocate_slice(Env* env, Object_List* list, i32 start, i32 count) {
+  Object_Slice* slice = (Object_Slice*)allocate_object(env, sizeof(Object_Slice), Ok_Slice);
+  slice->list = list;
+  slice->start = start;
+  slice->count = count;
+  return slice;
+}
+
+// elements of a list or a slice
+value* list_values(value val, i32* count) {
+  if(Object_isSlice(val)) {
+    Object_Slice* slice = Object_asSlice(val);
+    *count = slice->count;
+    return slice->list->vector.data + slice->start;
+  }
+  *count = Object_asList(val)->vector.count;
+  return Object_asList(val)->vector.data;
+}
+
+// count elements, left for the caller to fill in
+Object_Array* allocate_array(Env* env, i32 count) {
+  Object_Array* array = (Object_Array*)allocate_object(env, sizeof(Object_Array), Ok_Array);
+  double_vector_allocate(&array->vector);
+  double_vector_reserve(&array->vector, count);
+  array->vector.count = count;
+  gc_account(env, sizeof(double) * array->vector.cap);
+  return array;
+}
+
+void array_append(Env* env, Object_Array* array, double num) {
+  i32 old_cap = array->vector.cap;
+  double_vector_pushback(&array->vector, num);
+  if(array->vector.cap != old_cap)
+    gc_account(env, sizeof(double) * (array->vector.cap - old_cap));
+}
+
+Object_Dict* allocate_dict(Env* env) {
+  Object_Dict* dict = (Object_Dict*)allocate_object(env, sizeof(Object_Dict), Ok_Dict);
+  table_allocate(&dict->table);
+  gc_account(env, (sizeof(Entry) +1) * dict->table.cap);
+  return dict;
+}
+
+// key has to come from dict_key()
+void dict_set(Env* env, Object_Dict* dict, value key, value val) {
+  i32 old_cap = dict->table.cap;
+  table_set(&dict->table, key, val);
+  gc_write_barrier(env, (Object*)dict, key);
+  gc_write_barrier(env, (Object*)dict, val);
+  if(dict->table.cap != old_cap)
+    gc_account(env, (sizeof(Entry) +1) * (dict->table.cap - old_cap));
+}
+
+int string_length(Object* object) {
+  if(object->kind == Ok_Rope) return ((Object_Rope*)object)->len;
+  return ((Object_String*)object)->len;
+}
+
+// both halves have to be reachable by the collector while this allocates
+Object_Rope* allocate_rope(Env* env, Object* left, Object* right) {
+  Object_Rope* rope = (Object_Rope*)allocate_object(env, sizeof(Object_Rope),
+    Ok_Rope);
+  rope->left = left;
+  rope->right = right;
+  rope->str = NULL;
+  rope->len = string_length(left) + string_length(right);
+  return rope;
+}
+
+// copies the whole tree into dst, which holds rope->len +1 chars. it is
+// filled from the back so the left leaning chain s = s + x builds never has
+// more than one node pending
+static void rope_copy(Object_Rope* rope, char* dst) {
+  dst[rope->len] = '\0';
+  int end = rope->len;
+
+  Object** pending = NULL;
+  i32 count = 0, cap = 0;
+  Object* node = (Object*)rope;
+  for(;;) {
+    if(node->kind == Ok_Rope && ((Object_Rope*)node)->str == NULL) {
+      if(cap < count +1) {
+        cap = cap < 8 ? 8 : cap * 2;
+        pending = REALLOCATE(Object*, pending, cap);
+      }
+      pending[count] = ((Object_Rope*)node)->left;
+      count += 1;
+      node = ((Object_Rope*)node)->right;
+      continue;
+    }
+
+    // a string or an already flattened rope
+    int len = string_length(node);
+    char* chars = node->kind == Ok_Rope ?
+      ((Object_Rope*)node)->str : ((Object_String*)node)->str;
+    end -= len;
+    memcpy(dst + end, chars, len);
+    if(count == 0) break;
+    count -= 1;
+    node = pending[count];
+  }
+  FREE(pending);
+}
+
+// builds the flat copy once and keeps it, the collector counts it like the
+// rest of the rope
+char* rope_flatten(Env* env, Object_Rope* rope) {
+  if(rope->str != NULL) return rope->str;
+
+  char* dst = ALLOCATE(char, rope->len +1);
+  rope_copy(rope, dst);
+  gc_account(env, rope->len +1);
+  rope->str = dst;
+  rope->left = rope->right = NULL;
+  return dst;
+}
+
+// characters of a string or a rope, flattening the rope if needed
+char* string_chars(Env* env, Object* object, int* len) {
+  if(object->kind == Ok_Rope) {
+    Object_Rope* rope = (Object_Rope*)object;
+    *len = rope->len;
+    return rope_flatten(env, rope);
+  }
+  Object_String* str = (Object_String*)object;
+  *len = str->len;
+  return str->str;
+}
+
+// two interned strings are equal only if they are the same object. other
+// strings compare length, then hash if both already have one, then
+// characters. hashing just to compare once costs more than the memcmp
+bool strings_equal(Env* env, Object* x, Object* y) {
+  if(x == y) return true;
+  if(string_length(x) != string_length(y)) return false;
+
+  if(x->kind == Ok_String && y->kind == Ok_String) {
+    Object_String* a = (Object_String*)x;
+    Object_String* b = (Object_String*)y;
+    if(a->is_interned && b->is_interned) return false;
+    if(a->has_hash && b->has_hash && a->hash != b->hash) return false;
+  }
+
+  int len;
+  char* x_chars = string_chars(env, x, &len);
+  char* y_chars = string_chars(env, y, &len);
+  return memcmp(x_chars, y_chars, len) == 0;
+}
 
 Object_Function* make_function(Env* env) {
   Object_Function* fn = (Object_Function*)allocate_object(env, sizeof(Object_Function), Ok_Function);
@@ -96,17 +359,63 @@ Object_Function* make_function(Env* env) {
   return fn;
 }
 
+Object_Native* make_native(Env* env, Native_Fn fn, i32 arity, Object_String* name) {
+  Object_Native* native = (Object_Native*)allocate_object(env, sizeof(Object_Native), Ok_Native);
+  native->fn = fn;
+  native->arity = arity;
+  native->name = name;
+  return native;
+}
+
 void print_list(value val) {
   putc('[', stdout);
-  Object_List* list = Object_asList(val);
-  print_value(list->vector.data[0]);
-  for(i32 x = 1; x < list->vector.count; x+=1) {
-    printf(", ");
-    print_value(list->vector.data[x]);
+  i32 count;
+  value* values = list_values(val, &count);
+  for(i32 x = 0; x < count; x+=1) {
+    if(x > 0) printf(", ");
+    print_value(values[x]);
+  }
+  putc(']', stdout);
+}
+
+void print_array(value val) {
+  Object_Array* array = Object_asArray(val);
+  putc('[', stdout);
+  for(i32 x = 0; x < array->vector.count; x+=1) {
+    if(x > 0) printf(", ");
+    print_value(Value_Number(array->vector.data[x]));
   }
   putc(']', stdout);
 }
 
+// in slot order, which has nothing to do with the order keys were added in
+void print_dict(value val) {
+  Table* table = &Object_asDict(val)->table;
+  putc('{', stdout);
+  bool first = true;
+  for(i32 x = table_next(table, 0); x != -1; x = table_next(table, x +1)) {
+    if(!first) printf(", ");
+    first = false;
+    print_value(table->entries[x].key);
+    printf(": ");
+    print_value(table->entries[x].val);
+  }
+  putc('}', stdout);
+}
+
+// printing has no env to count a kept copy against, a rope nobody flattened
+// yet is copied into a scratch buffer instead
+void print_rope(Object_Rope* rope) {
+  if(rope->str != NULL) {
+    printf("%s", rope->str);
+    return;
+  }
+  char* chars = ALLOCATE(char, rope->len +1);
+  rope_copy(rope, chars);
+  printf("%s", chars);
+  FREE(chars);
+}
+
 void print_function(value fn) {
   printf("<%s fn>", Object_asFunction(fn)->name->str);
 }
@@ -117,9 +426,23 @@ void print_object(value val) {
       printf("%s", Get_Object_CString(val));
       break;
     case Ok_List:
+    case Ok_Slice:
       print_list(val);
       break;
+    case Ok_Array:
+      print_array(val);
+      break;
+    case Ok_Dict:
+      print_dict(val);
+      break;
     case Ok_Function:
       print_function(val);
+      break;
+    case Ok_Rope:
+      print_rope(Object_asRope(val));
+      break;
+    case Ok_Native:
+      printf("<%s native fn>", Object_asNative(val)->name->str);
+      break;
   }
 }
@@ -6,10 +6,18 @@ typedef enum {
   Ok_String,
   Ok_List,
   Ok_Function,
+  Ok_Rope,
+  Ok_Native,
+  Ok_Slice,
+  Ok_Array,
+  Ok_Dict,
 } Object_Kind;
 
 struct Object {
   Object_Kind kind;
+  bool is_marked;
+  bool is_old;
+  bool is_remembered;
   struct Object* next;
 };
 #define Get_Object_Kind(val)    (Value_asObject(val)->kind)
@@ -21,16 +29,62 @@ struct Object_List {
 #define Object_asList(val)    ((Object_List*)Value_asObject(val))
 #define Object_isList(val)    (object_istype(val, Ok_List))
 
+// count elements of list from start on, sharing the list's buffer. it goes
+// through the list on every access so an append moving the buffer is fine,
+// lists never shrink so the elements stay in range
+typedef struct {
+  Object object;
+  Object_List* list;
+  i32 start, count;
+} Object_Slice;
+#define Object_asSlice(val)   ((Object_Slice*)Value_asObject(val))
+#define Object_isSlice(val)   (object_istype(val, Ok_Slice))
+// lists and slices
+#define Object_isListLike(val) (Object_isList(val) || Object_isSlice(val))
+
+// a list that only holds numbers, stored unboxed one after the other so
+// the kernels in array.c can go through them with SIMD instructions
+typedef struct {
+  Object object;
+  double_vector vector;
+} Object_Array;
+#define Object_asArray(val)   ((Object_Array*)Value_asObject(val))
+#define Object_isArray(val)   (object_istype(val, Ok_Array))
+
+// literals and identifiers are interned, equal ones are the same object.
+// strings made at runtime aren't and hash them only once somebody asks
+// through string_hash()
 struct Object_String {
   Object object;
   char* str;
   int len;
   uint32_t hash;
+  bool is_interned;
+  bool has_hash;
+  bool is_borrowed; // str belongs to somebody else, see borrow_string()
 };
 #define Object_isString(val)    (object_istype(val, Ok_String))
 #define Object_asString(val)    ((Object_String*)Value_asObject(val))
 #define Get_Object_CString(val) (((Object_String*)Value_asObject(val))->str)
 
+// result of a concatenation whose characters aren't copied until somebody
+// needs them. left and right are strings or ropes. rope_flatten() builds str
+// once and drops the children, a rope is never interned
+typedef struct {
+  Object object;
+  Object* left;
+  Object* right;
+  char* str;
+  int len;
+} Object_Rope;
+#define Object_isRope(val)      (object_istype(val, Ok_Rope))
+#define Object_asRope(val)      ((Object_Rope*)Value_asObject(val))
+
+// concatenations shorter than this are copied right away into a flat runtime string
+#ifndef Rope_Min_Len
+  #define Rope_Min_Len 64
+#endif
+
 typedef struct {
   Object object;
   byte_vector code;
@@ -41,15 +95,54 @@ typedef struct {
 #define Object_isFunction(val)  (object_istype(val, Ok_Function))
 #define Object_asFunction(val)  ((Object_Function*)Value_asObject(val))
 
+// A procedure written in C. args points at the argc arguments on the eval
+// stack, they are only borrowed for the call. the result replaces them, a
+// native that fails reports it through runtime_error() and returns
+// Value_Undefined(). natives may allocate, the arguments stay rooted
+typedef struct Env Env;
+typedef value (*Native_Fn)(Env* env, i32 argc, value* args);
+
+typedef struct {
+  Object object;
+  Native_Fn fn;
+  i32 arity;      // -1 takes any number of arguments
+  Object_String* name;
+} Object_Native;
+
+#define Object_isNative(val)    (object_istype(val, Ok_Native))
+#define Object_asNative(val)    ((Object_Native*)Value_asObject(val))
+
 static inline bool object_istype(value val, Object_Kind kind) {
   return Value_isObject(val) && Value_asObject(val)->kind == kind;
 }
 
-typedef struct Env Env;
+// strings and ropes
+static inline bool object_isstringlike(value val) {
+  return Value_isObject(val) && (Value_asObject(val)->kind == Ok_String ||
+    Value_asObject(val)->kind == Ok_Rope);
+}
+#define Object_isStringLike(val) (object_isstringlike(val))
+
 Object_String* allocate_string(Env* env, char* str, int len, uint32_t hash);
 Object_String* take_string(Env* env, char* str, int len);
+Object_String* take_runtime_string(Env* env, char* str, int len);
+Object_String* borrow_string(Env* env, char* str, int len, uint32_t hash);
+uint32_t string_hash(Object_String* str);
+void free_object(Object* object);
 void free_objects(Env* env);
 Object_String* object_string_cpy(Env* env, char* chars, int len);
 Object_List* allocate_list(Env* env);
+Object_List* allocate_list_cap(Env* env, i32 cap);
+Object_Slice* allocate_slice(Env* env, Object_List* list, i32 start, i32 count);
+void list_append(Env* env, Object_List* list, value val);
+value* list_values(value val, i32* count);
+Object_Array* allocate_array(Env* env, i32 count);
+void array_append(Env* env, Object_Array* array, double num);
 void print_object(value val);
 Object_Function* make_function(Env* env);
+Object_Native* make_native(Env* env, Native_Fn fn, i32 arity, Object_String* name);
+Object_Rope* allocate_rope(Env* env, Object* left, Object* right);
+char* rope_flatten(Env* env, Object_Rope* rope);
+char* string_chars(Env* env, Object* object, int* len);
+int string_length(Object* object);
+bool strings_equal(Env* env, Object* x, Object* y);
@@ -0,0 +1,317 @@
+#include "object.h"
+#include "machine.h"
+
+// Peephole pass over env->stream and the code of every procedure. Runs once
+// after parsing and before interpret(). The code is decoded into a list of instructions with jump
+// targets turned into instruction indices, rewritten in place and encoded
+// again with freshly computed jump offsets.
+//
+// Rewrites done here:
+//   GREATER, NOT             -> LESS_EQUAL
+//   LESS, NOT                -> GREATER_EQUAL
+//   EQUAL, NOT               -> NOT_EQUAL
+//   JUMP_IF_FALSE L, POP ... L: POP
+//                            -> JUMP_IF_FALSE_POP L+1
+//   GET_LOCAL x, PUSH_CONSTANT k, ADD, SET_LOCAL x, POP
+//                            -> INC_LOCAL_CONST x k    (small integer k)
+//                            -> ADD_LOCAL_CONST x k    (any other number)
+//   GET_LOCAL x, PUSH_CONSTANT k, LESS, JUMP_IF_FALSE_POP L
+//                            -> JUMP_IF_LOCAL_GE_CONST x k L
+//   jumps landing on an unconditional jump go straight to its target
+//   jumps to the very next instruction are dropped
+
+typedef struct {
+  byte op;
+  byte operand[4];
+  i32 offset;   // offset in the original stream
+  i32 target;   // instruction index for jumps, -1 otherwise
+  i32 refs;     // number of jumps landing on this instruction
+  bool removed;
+} Inst;
+
+typedef struct {
+  Inst* insts;
+  i32 count;
+} Inst_List;
+
+static bool is_jump(byte op) {
+  return op == Op_Jump || op == Op_Jump_If_False ||
+    op == Op_Jump_If_False_Pop || op == Op_Loop ||
+    op == Op_Jump_If_Local_Ge_Const;
+}
+
+// the jump distance is always the last 2 operand bytes
+static i32 jump_operand(byte op) {
+  return opcode_length(op) -3;
+}
+
+// true if control never falls through to the next instruction
+static bool is_terminator(byte op) {
+  return op == Op_Jump || op == Op_Loop || op == Op_Return;
+}
+
+static void decode(byte_vector* stream, Inst_List* list) {
+  byte* code = stream->data;
+  i32 len = stream->count;
+
+  // offset -> instruction index, only filled at instruction starts
+  i32* at_offset = ALLOCATE(i32, len +1);
+  list->insts = ALLOCATE(Inst, len);
+  list->count = 0;
+
+  for(i32 offset = 0; offset < len; offset += opcode_length(code[offset])) {
+    Inst* inst = &list->insts[list->count];
+    inst->op = code[offset];
+    inst->offset = offset;
+    inst->target = -1;
+    inst->refs = 0;
+    inst->removed = false;
+    for(i32 x = 1; x < opcode_length(inst->op); x+=1)
+      inst->operand[x -1] = code[offset +x];
+
+    at_offset[offset] = list->count;
+    list->count += 1;
+  }
+  at_offset[len] = list->count;
+
+  for(i32 x = 0; x < list->count; x+=1) {
+    Inst* inst = &list->insts[x];
+    if(!is_jump(inst->op)) continue;
+
+    i32 at = jump_operand(inst->op);
+    i32 distance = (inst->operand[at] << 8) | inst->operand[at +1];
+    i32 next = inst->offset + opcode_length(inst->op);
+    inst->target = at_offset[inst->op == Op_Loop ? next - distance : next + distance];
+  }
+  FREE(at_offset);
+}
+
+static void count_refs(Inst_List* list) {
+  for(i32 x = 0; x < list->count; x+=1)
+    list->insts[x].refs = 0;
+  for(i32 x = 0; x < list->count; x+=1) {
+    Inst* inst = &list->insts[x];
+    if(!inst->removed && inst->target != -1 && inst->target < list->count)
+      list->insts[inst->target].refs += 1;
+  }
+}
+
+// next instruction that is still alive after idx, list->count if none
+static i32 next_live(Inst_List* list, i32 idx) {
+  idx += 1;
+  while(idx < list->count && list->insts[idx].removed)
+    idx += 1;
+  return idx;
+}
+
+// first live instruction at or after idx, a jump to a removed instruction
+// ends up there
+static i32 live_at(Inst_List* list, i32 idx) {
+  if(idx >= list->count) return idx;
+  return list->insts[idx].removed ? next_live(list, idx) : idx;
+}
+
+static void thread_jumps(Inst_List* list) {
+  for(i32 x = 0; x < list->count; x+=1) {
+    Inst* inst = &list->insts[x];
+    if(inst->removed || inst->target == -1) continue;
+
+    // bounded, a cycle of jumps would otherwise never end
+    for(i32 hops = 0; hops < 8 && inst->target < list->count; hops+=1) {
+      Inst* dst = &list->insts[inst->target];
+      i32 new_target = -1;
+
+      if(dst->op == Op_Jump)
+        new_target = dst->target;
+      // falsey value is still on the stack so the second test jumps too
+      else if(inst->op == Op_Jump_If_False && dst->op == Op_Jump_If_False)
+        new_target = dst->target;
+      if(new_target == -1) break;
+
+      // conditional jumps can only go forward and jump operands are 16 bits
+      if(inst->op != Op_Jump && inst->op != Op_Loop && new_target <= x)
+        break;
+      if(abs(list->insts[new_target].offset - inst->offset) > UINT16_MAX)
+        break;
+      inst->target = new_target;
+    }
+  }
+}
+
+static void fuse(Env* env, Inst_List* list) {
+  count_refs(list);
+  for(i32 x = 0; x < list->count; x+=1) {
+    Inst* inst = &list->insts[x];
+    if(inst->removed) continue;
+    i32 n1 = next_live(list, x);
+    if(n1 >= list->count) break;
+    Inst* next = &list->insts[n1];
+
+    if(next->op == Op_Not && next->refs == 0) {
+      byte fused = 0;
+      if(inst->op == Op_Greater) fused = Op_Less_Equal;
+      else if(inst->op == Op_Less) fused = Op_Greater_Equal;
+      else if(inst->op == Op_Equal) fused = Op_Not_Equal;
+      if(fused) {
+        inst->op = fused;
+        next->removed = true;
+        continue;
+      }
+    }
+
+    // both ways out of the test pop the condition. the POP at the target
+    // can only go if nothing else reaches it, neither another jump nor by
+    // falling through from the instruction before it
+    if(inst->op == Op_Jump_If_False && next->op == Op_Pop && next->refs == 0) {
+      i32 t = live_at(list, inst->target);
+      Inst* dst = &list->insts[t];
+      i32 before = t -1;
+      while(before >= 0 && list->insts[before].removed)
+        before -= 1;
+
+      if(t < list->count && dst->op == Op_Pop && dst->refs == 1 &&
+        before >= 0 && is_terminator(list->insts[before].op)) {
+        inst->op = Op_Jump_If_False_Pop;
+        next->removed = true;
+        dst->removed = true;
+        inst->target = next_live(list, t);
+        count_refs(list);
+        continue;
+      }
+    }
+
+    // x += k on a local used as a statement. x -= k is left alone, the
+    // fused ops add arrays too and SUB doesn't take them
+    if(inst->op == Op_Get_Local && next->op == Op_Push_Constant) {
+      i32 n2 = next_live(list, n1);
+      i32 n3 = next_live(list, n2);
+      i32 n4 = next_live(list, n3);
+      if(n4 >= list->count) continue;
+      Inst* add = &list->insts[n2];
+      Inst* set = &list->insts[n3];
+      Inst* pop = &list->insts[n4];
+      value k = env->constants.data[next->operand[0]];
+
+      if(add->op == Op_Add && set->op == Op_Set_Local &&
+        pop->op == Op_Pop && set->operand[0] == inst->operand[0] &&
+        Value_isNumber(k) &&
+        next->refs == 0 && add->refs == 0 && set->refs == 0 && pop->refs == 0) {
+        double step = Value_asNumber(k);
+
+        if(step >= INT8_MIN && step <= INT8_MAX && step == (int8_t)step) {
+          inst->op = Op_Inc_Local_Const;
+          inst->operand[1] = (byte)(int8_t)step;
+        }
+        else {
+          inst->op = Op_Add_Local_Const;
+          inst->operand[1] = next->operand[0];
+        }
+        next->removed = add->removed = set->removed = pop->removed = true;
+      }
+    }
+  }
+}
+
+// second round, builds on what fuse() produced
+static void fuse_loop_tests(Env* env, Inst_List* list) {
+  count_refs(list);
+  for(i32 x = 0; x < list->count; x+=1) {
+    Inst* inst = &list->insts[x];
+    if(inst->removed || inst->op != Op_Get_Local) continue;
+
+    i32 n1 = next_live(list, x);
+    i32 n2 = next_live(list, n1);
+    i32 n3 = next_live(list, n2);
+    if(n3 >= list->count) break;
+    Inst* push = &list->insts[n1];
+    Inst* less = &list->insts[n2];
+    Inst* jump = &list->insts[n3];
+
+    if(push->op == Op_Push_Constant && less->op == Op_Less &&
+      jump->op == Op_Jump_If_False_Pop &&
+      Value_isNumber(env->constants.data[push->operand[0]]) &&
+      push->refs == 0 && less->refs == 0 && jump->refs == 0) {
+      inst->op = Op_Jump_If_Local_Ge_Const;
+      inst->operand[1] = push->operand[0];
+      inst->target = jump->target;
+      push->removed = less->removed = jump->removed = true;
+    }
+  }
+}
+
+static void drop_jumps_to_next(Inst_List* list) {
+  for(i32 x = 0; x < list->count; x+=1) {
+    Inst* inst = &list->insts[x];
+    if(inst->removed || inst->op != Op_Jump) continue;
+    if(live_at(list, inst->target) == next_live(list, x))
+      inst->removed = true;
+  }
+}
+
+static void encode(byte_vector* stream, Inst_List* list) {
+  // new offset of every instruction, removed ones take the offset of the
+  // next live one so jumps to them land on the right place
+  i32* new_offset = ALLOCATE(i32, list->count +1);
+  i32 offset = 0;
+  for(i32 x = 0; x < list->count; x+=1) {
+    new_offset[x] = offset;
+    if(!list->insts[x].removed)
+      offset += opcode_length(list->insts[x].op);
+  }
+  new_offset[list->count] = offset;
+
+  byte_reset(stream);
+  for(i32 x = 0; x < list->count; x+=1) {
+    Inst* inst = &list->insts[x];
+    if(inst->removed) continue;
+
+    if(inst->target != -1) {
+      i32 next = new_offset[x] + opcode_length(inst->op);
+      i32 dst = new_offset[inst->target];
+      // an unconditional jump threaded backwards becomes a loop and the
+      // other way around
+      if(inst->op == Op_Jump && dst < next) inst->op = Op_Loop;
+      else if(inst->op == Op_Loop && dst >= next) inst->op = Op_Jump;
+
+      i32 distance = inst->op == Op_Loop ? next - dst : dst - next;
+      i32 at = jump_operand(inst->op);
+      inst->operand[at] = (distance >> 8) & 0xFF;
+      inst->operand[at +1] = distance & 0xFF;
+    }
+
+    byte_vector_pushback(stream, inst->op);
+    for(i32 y = 1; y < opcode_length(inst->op); y+=1)
+      byte_vector_pushback(stream, inst->operand[y -1]);
+  }
+  FREE(new_offset);
+}
+
+static i32 optimize_code(Env* env, byte_vector* stream) {
+  if(stream->count == 0) return 0;
+
+  Inst_List list;
+  decode(stream, &list);
+  i32 before = list.count;
+
+  thread_jumps(&list);
+  fuse(env, &list);
+  fuse_loop_tests(env, &list);
+  drop_jumps_to_next(&list);
+  encode(stream, &list);
+
+  i32 after = 0;
+  for(i32 x = 0; x < list.count; x+=1)
+    after += !list.insts[x].removed;
+  FREE(list.insts);
+  return before - after;
+}
+
+// returns the number of instructions that were removed
+i32 optimize_bytecode(Env* env) {
+  i32 removed = optimize_code(env, &env->stream);
+  for(i32 x = 0; x < env->constants.count; x+=1) {
+    if(Object_isFunction(env->constants.data[x]))
+      removed += optimize_code(env, &Object_asFunction(env->constants.data[x])->code);
+  }
+  return removed;
+}
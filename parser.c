@@ -13,14 +13,43 @@ typedef struct {
   int active_on;
 } Local;
 
+// locals of the procedure being compiled, or of the script. a procedure's
+// parameters are its first locals
 typedef struct {
   Local locals[16];
   int count;
   int scope_depth;
+  bool in_proc;
 } Locals_Info;
 
 Locals_Info locals_info;
 
+// Side index over env->constants so that equal constants share one slot.
+// numbers are keyed by their bit pattern, strings by their interned pointer.
+// slots hold an index into env->constants or -1 when empty
+typedef struct {
+  i32* slots;
+  i32 count, cap;
+} Constant_Index;
+
+Constant_Index constant_index;
+
+// The last instruction that pushed a value known at compile time. constant
+// folding looks back at it to tell whether an operand was a literal instead
+// of building an expression tree. start is -1 when there is none, pool is
+// the constant count from before the push
+typedef struct {
+  i32 start, end;
+  value val;
+  i32 pool;
+} Known_Value;
+
+Known_Value last_known;
+
+// stream offset right behind the last Op_List_Subscript, so the delete
+// statement can tell that its expression ended in one
+i32 last_subscript_end;
+
 // Token consumption and error reporting
 static void error_at(Token* token, char* descr) {
   if(parser.panic_mode) return;
@@ -68,6 +97,7 @@ static void parser_sync(void) {
       case Tk_If:
       case Tk_Print:
       case Tk_Return:
+      case Tk_Delete:
         return;
       default: ;// do nothing
     }
@@ -108,17 +138,168 @@ void emit_3bytes(Env* env, byte a, byte b, byte c) {
   byte_vector_pushback(&env->stream, c);
 }
 
-static void emit_constant(Env* env, value val) {
+static uint64_t constant_key(value val) {
+  uint64_t key = 0;
+  if(Value_isNumber(val)) {
+    double num = Value_asNumber(val);
+    memcpy(&key, &num, sizeof(double));
+  }
+  else if(Value_isObject(val))
+    key = (uintptr_t)Value_asObject(val);
+
+  // mix the bits, pointers and small doubles differ only in a few of them
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static bool constants_same(value a, value b) {
+  if(Value_isNumber(a) && Value_isNumber(b))
+    return constant_key(a) == constant_key(b);
+  if(Value_isObject(a) && Value_isObject(b))
+    return Value_asObject(a) == Value_asObject(b);
+  return false;
+}
+
+static void constant_index_allocate(void) {
+  constant_index.slots = ALLOCATE(i32, 64);
+  constant_index.count = 0;
+  constant_index.cap = 64;
+  memset(constant_index.slots, -1, sizeof(i32) * constant_index.cap);
+}
+
+static void constant_index_deallocate(void) {
+  FREE(constant_index.slots);
+  constant_index.count = 0;
+  constant_index.cap = 0;
+}
+
+// cap is always a power of 2, so masking wraps the probe around
+static i32* constant_index_find(Env* env, value val) {
+  u32 mask = constant_index.cap -1;
+  u32 idx = constant_key(val) & mask;
+  for(;;) {
+    i32* slot = &constant_index.slots[idx];
+    if(*slot == -1 || constants_same(env->constants.data[*slot], val))
+      return slot;
+    idx = (idx +1) & mask;
+  }
+}
+
+static void constant_index_grow(Env* env) {
+  i32* old_slots = constant_index.slots;
+  i32 old_cap = constant_index.cap;
+
+  constant_index.cap *= 2;
+  constant_index.slots = ALLOCATE(i32, constant_index.cap);
+  memset(constant_index.slots, -1, sizeof(i32) * constant_index.cap);
+  for(i32 x = 0; x < old_cap; x+=1) {
+    if(old_slots[x] == -1) continue;
+    *constant_index_find(env, env->constants.data[old_slots[x]]) = old_slots[x];
+  }
+  FREE(old_slots);
+}
+
+// returns the index of val in env->constants, adding it only if no equal
+// constant exists yet
+static i32 make_constant(Env* env, value val) {
+  if(constant_index.count +1 > constant_index.cap * 3 / 4)
+    constant_index_grow(env);
+
+  i32* slot = constant_index_find(env, val);
+  if(*slot != -1) return *slot;
+
   value_vector_pushback(&env->constants, val);
-  i32 idx = env->constants.count -1;
-  if(idx > UINT8_MAX)
+  *slot = env->constants.count -1;
+  constant_index.count += 1;
+  return *slot;
+}
+
+// drops the constants added since the pool held count of them. folding uses
+// it once the pushes of the operands are gone, nothing else refers to those.
+// the index is linear probing, later entries of a probe run move back into
+// the hole unless that would put them before their home slot
+static void drop_constants(Env* env, i32 count) {
+  u32 mask = constant_index.cap -1;
+  while(env->constants.count > count) {
+    value val = env->constants.data[env->constants.count -1];
+    u32 hole = constant_index_find(env, val) - constant_index.slots;
+    for(u32 idx = (hole +1) & mask; constant_index.slots[idx] != -1; idx = (idx +1) & mask) {
+      value moved = env->constants.data[constant_index.slots[idx]];
+      u32 home = constant_key(moved) & mask;
+      if(((idx - home) & mask) >= ((idx - hole) & mask)) {
+        constant_index.slots[hole] = constant_index.slots[idx];
+        hole = idx;
+      }
+    }
+    constant_index.slots[hole] = -1;
+    constant_index.count -= 1;
+    env->constants.count -= 1;
+  }
+  gc_drop_constants(env, count);
+}
+
+// the first 256 constants fit a 1 byte operand, the rest use the 3 byte one
+static void emit_constant(Env* env, value val) {
+  i32 start = env->stream.count;
+  i32 pool = env->constants.count;
+  i32 idx = make_constant(env, val);
+  if(idx <= UINT8_MAX)
+    emit_2bytes(env, Op_Push_Constant, idx);
+  else if(idx <= 0xFFFFFF) {
+    emit_1byte(env, Op_Push_Constant_Long);
+    emit_3bytes(env, (idx >> 16) & 0xFF, (idx >> 8) & 0xFF, idx & 0xFF);
+  }
+  else
     error("Constant count > max constants count.. not allowed");
-  emit_2bytes(env, Op_Push_Constant, idx); 
+
+  last_known.start = start;
+  last_known.end = env->stream.count;
+  last_known.val = val;
+  last_known.pool = pool;
 }
-static uint8_t identifier_constant(Env* env, Token* name) {
-  value_vector_pushback(&env->constants,
-    Value_Object(object_string_cpy(env, name->str, name->len)));
-  return env->constants.count -1;
+
+// pushes a value known at compile time with the cheapest instruction
+static void emit_known(Env* env, value val) {
+  i32 start = env->stream.count;
+  if(Value_isBool(val))
+    emit_1byte(env, Value_asBool(val) ? Op_True : Op_False);
+  else if(Value_isNull(val))
+    emit_1byte(env, Op_Null);
+  else {
+    emit_constant(env, val);
+    return;
+  }
+  last_known.start = start;
+  last_known.end = env->stream.count;
+  last_known.val = val;
+  last_known.pool = env->constants.count;
+}
+
+// true if everything emitted from start on is a single push of a known value
+static bool known_from(Env* env, i32 start, value* val) {
+  if(last_known.start != start || last_known.end != env->stream.count)
+    return false;
+  *val = last_known.val;
+  return true;
+}
+
+// globals never go through the constant pool, every name is given a dense
+// slot once and all later references to it reuse that slot
+static i32 identifier_slot(Env* env, Token* name) {
+  i32 slot = global_slot(env, object_string_cpy(env, name->str, name->len));
+  if(slot > UINT16_MAX)
+    error("Global count > max globals count.. not allowed");
+  return slot;
+}
+
+// locals take a 1 byte slot, globals a 2 byte one
+static void emit_variable_op(Env* env, byte op, i32 idx) {
+  if(op == Op_Get_Local || op == Op_Set_Local)
+    emit_2bytes(env, op, idx);
+  else
+    emit_3bytes(env, op, (idx >> 8) & 0xFF, idx & 0xFF);
 }
 
 static i32 emit_jump(Env* env, byte b) {
@@ -144,6 +325,10 @@ static void patch_jump(Env* env, i32 offset) {
 
   env->stream.data[offset] = (jump >> 8) & 0xFF;
   env->stream.data[offset +1] = jump & 0xFF;
+
+  // a jump lands right after the last push, whatever comes next can no
+  // longer treat that push as a plain literal
+  last_known.start = -1;
 }
 
 // Parsing routines
@@ -184,8 +369,25 @@ static void parse_number(Env* env, bool assignable) {
 static void parse_unary(Env* env, bool assignable) {
   (void)assignable;
   i32 op_kind = parser.previous.kind;
+  i32 start = env->stream.count;
   parse_expr(env, Prec_Unary);
 
+  value operand;
+  if(known_from(env, start, &operand)) {
+    if(op_kind == Tk_Bang) {
+      env->stream.count = start;
+      drop_constants(env, last_known.pool);
+      emit_known(env, Value_Bool(is_falsey(operand)));
+      return;
+    }
+    if(op_kind == Tk_Minus && Value_isNumber(operand)) {
+      env->stream.count = start;
+      drop_constants(env, last_known.pool);
+      emit_known(env, Value_Number(-Value_asNumber(operand)));
+      return;
+    }
+  }
+
   switch(op_kind) {
     case Tk_Minus: emit_1byte(env, Op_Neg); break;
     case Tk_Bang:  emit_1byte(env, Op_Not); break;
@@ -196,9 +398,9 @@ static void parse_unary(Env* env, bool assignable) {
 static void parse_literal(Env* env, bool assignable) {
   (void)assignable;
   switch(parser.previous.kind) {
-    case Tk_True:   emit_1byte(env, Op_True); break;
-    case Tk_False:  emit_1byte(env, Op_False); break;
-    case Tk_Null:   emit_1byte(env, Op_Null); break;
+    case Tk_True:   emit_known(env, Value_Bool(true)); break;
+    case Tk_False:  emit_known(env, Value_Bool(false)); break;
+    case Tk_Null:   emit_known(env, Value_Null()); break;
     default: return;
   }
 }
@@ -227,48 +429,48 @@ static int resolve_local(Token* name) {
 }
 
 static void parse_ident(Env* env, bool assignable) {
-  uint8_t get_op, set_op;
+  byte get_op, set_op;
   int idx = resolve_local(&parser.previous);
   if(idx != -1) {
     get_op = Op_Get_Local;
     set_op = Op_Set_Local;
   }
   else {
-    idx = identifier_constant(env, &parser.previous);
-    get_op = Op_Get_Global;
-    set_op = Op_Set_Global;
+    idx = identifier_slot(env, &parser.previous);
+    get_op = Op_Get_Global_Slot;
+    set_op = Op_Set_Global_Slot;
   }
 
   if(match_token(Tk_Equal) && assignable) {
     parse_expr(env, Prec_Assign);
-    emit_2bytes(env, set_op, (uint8_t)idx);
+    emit_variable_op(env, set_op, idx);
   }
   else if(match_token(Tk_Plus_Equal) && assignable) {
-    emit_2bytes(env, get_op, (uint8_t)idx);
+    emit_variable_op(env, get_op, idx);
     parse_expr(env, Prec_Assign);
     emit_1byte(env, Op_Add);
-    emit_2bytes(env, set_op, (uint8_t)idx);
+    emit_variable_op(env, set_op, idx);
   }
   else if(match_token(Tk_Minus_Equal) && assignable) {
-    emit_2bytes(env, get_op, (uint8_t)idx);
+    emit_variable_op(env, get_op, idx);
     parse_expr(env, Prec_Assign);
     emit_1byte(env, Op_Sub);
-    emit_2bytes(env, set_op, (uint8_t)idx);
+    emit_variable_op(env, set_op, idx);
   }
   else if(match_token(Tk_Star_Equal) && assignable) {
-    emit_2bytes(env, get_op, (uint8_t)idx);
+    emit_variable_op(env, get_op, idx);
     parse_expr(env, Prec_Assign);
     emit_1byte(env, Op_Mul);
-    emit_2bytes(env, set_op, (uint8_t)idx);
+    emit_variable_op(env, set_op, idx);
   }
   else if(match_token(Tk_Slash_Equal) && assignable) {
-    emit_2bytes(env, get_op, (uint8_t)idx);
+    emit_variable_op(env, get_op, idx);
     parse_expr(env, Prec_Assign);
     emit_1byte(env, Op_Div);
-    emit_2bytes(env, set_op, (uint8_t)idx);
+    emit_variable_op(env, set_op, idx);
   }
   else {
-    emit_2bytes(env, get_op, (uint8_t)idx);
+    emit_variable_op(env, get_op, idx);
   }
 }
 
@@ -293,20 +495,110 @@ static void parse_or(Env* env, bool assignable) {
   patch_jump(env, end_jump);
 }
 
+// the first chunk builds the list, later ones are appended to it
+static void emit_list_chunk(Env* env, bool built, i32 count) {
+  emit_1byte(env, built ? Op_List_Extend : Op_Build_List);
+  emit_1byte(env, (count >> 8) & 0xFF);
+  emit_1byte(env, count & 0xFF);
+}
+
+// literals longer than the 16 bit operand of Op_Build_List are built a
+// chunk at a time so no more than a chunk's worth sits on the stack
 static void parse_list(Env* env, bool assignable) {
   (void)assignable;
   i32 elem_count = 0;
-  parse_expr(env, Prec_Assign);
-  elem_count += 1;
-  while(!check_token(Tk_Right_SqrParen)) {
-    consume_token(Tk_Comma, "Missing ',' after expression in a list");
+  bool built = false;
+  if(match_token(Tk_Right_SqrParen)) {
+    emit_list_chunk(env, false, 0);
+    return;
+  }
+  for(;;) {
     parse_expr(env, Prec_Assign);
     elem_count += 1;
+    if(elem_count == UINT16_MAX) {
+      emit_list_chunk(env, built, elem_count);
+      built = true;
+      elem_count = 0;
+    }
+    if(check_token(Tk_Right_SqrParen) || check_token(Tk_Eof)) break;
+    consume_token(Tk_Comma, "Missing ',' after expression in a list");
   }
   consume_token(Tk_Right_SqrParen, "Incomplete Set of [] seen");
-  emit_1byte(env, Op_Build_List);
-  emit_1byte(env, (elem_count >> 8) & 0xFF);
-  emit_1byte(env, elem_count & 0xFF);
+  if(!built || elem_count > 0)
+    emit_list_chunk(env, built, elem_count);
+}
+
+// list[index], list[index] = value, list[] = value and list[lo:hi] where
+// either bound can be left out
+static void parse_index(Env* env, bool assignable) {
+  if(match_token(Tk_Right_SqrParen)) {
+    if(!assignable || !match_token(Tk_Equal)) {
+      error("Expect an index, only appending with '[] =' has none");
+      return;
+    }
+    parse_expr(env, Prec_Assign);
+    emit_1byte(env, Op_List_Append);
+    return;
+  }
+
+  if(check_token(Tk_Colon))
+    emit_1byte(env, Op_Null);
+  else
+    parse_expr(env, Prec_Assign);
+
+  if(match_token(Tk_Colon)) {
+    if(check_token(Tk_Right_SqrParen))
+      emit_1byte(env, Op_Null);
+    else
+      parse_expr(env, Prec_Assign);
+    consume_token(Tk_Right_SqrParen, "Missing ']' after slice");
+    emit_1byte(env, Op_List_Slice);
+    return;
+  }
+  consume_token(Tk_Right_SqrParen, "Missing ']' after indexing expression");
+
+  if(assignable && match_token(Tk_Equal)) {
+    parse_expr(env, Prec_Assign);
+    emit_1byte(env, Op_List_Store);
+  }
+  else {
+    emit_1byte(env, Op_List_Subscript);
+    last_subscript_end = env->stream.count;
+  }
+}
+
+// {key: value, ...}, the pairs are pushed key first. unlike lists the whole
+// literal has to fit the 16 bit operand of Op_Build_Dict
+static void parse_dict(Env* env, bool assignable) {
+  (void)assignable;
+  i32 pair_count = 0;
+  while(!check_token(Tk_Right_Brace) && !check_token(Tk_Eof)) {
+    parse_expr(env, Prec_Assign);
+    consume_token(Tk_Colon, "Missing ':' after a dictionary key");
+    parse_expr(env, Prec_Assign);
+    if(pair_count == UINT16_MAX)
+      error("Too many entries in a dictionary literal");
+    pair_count += 1;
+    if(check_token(Tk_Right_Brace)) break;
+    consume_token(Tk_Comma, "Missing ',' after an entry in a dictionary");
+  }
+  consume_token(Tk_Right_Brace, "Incomplete Set of {} seen");
+  emit_3bytes(env, Op_Build_Dict, (pair_count >> 8) & 0xFF, pair_count & 0xFF);
+}
+
+static void parse_call(Env* env, bool assignable) {
+  (void)assignable;
+  i32 argc = 0;
+  if(!check_token(Tk_Right_Paren)) {
+    do {
+      parse_expr(env, Prec_Assign);
+      if(argc == UINT8_MAX)
+        error("Too many arguments in a call");
+      argc += 1;
+    } while(match_token(Tk_Comma));
+  }
+  consume_token(Tk_Right_Paren, "Missing ')' after arguments");
+  emit_2bytes(env, Op_Call, argc);
 }
 
 static void parse_binary(Env*, bool);
@@ -315,13 +607,14 @@ Parse_Rule rules[] = {
   [Tk_Error] =          {NULL,          NULL,         Prec_None},
   [Tk_Eof] =            {NULL,          NULL,         Prec_None},
   [Tk_Right_Brace] =    {NULL,          NULL,         Prec_None},
-  [Tk_Left_Brace] =     {NULL,          NULL,         Prec_None},
-  [Tk_Left_Paren] =     {parse_group,   NULL,         Prec_None},
+  [Tk_Left_Brace] =     {parse_dict,    NULL,         Prec_None},
+  [Tk_Left_Paren] =     {parse_group,   parse_call,   Prec_Call},
   [Tk_Right_Paren] =    {NULL,          NULL,         Prec_None},
-  [Tk_Left_SqrParen] =  {parse_list,    parse_binary, Prec_Primary},
+  [Tk_Left_SqrParen] =  {parse_list,    parse_index,  Prec_Primary},
   [Tk_Right_SqrParen] = {NULL,          NULL,         Prec_None},
   [Tk_Comma] =          {NULL,          NULL,         Prec_None},
   [Tk_Semicolon] =      {NULL,          NULL,         Prec_None},
+  [Tk_Colon] =          {NULL,          NULL,         Prec_None},
 
   [Tk_Plus] =           {NULL,          parse_binary, Prec_Term},
   [Tk_Minus] =          {parse_unary,   parse_binary, Prec_Term},
@@ -357,13 +650,66 @@ Parse_Rule rules[] = {
   [Tk_Proc] =            {NULL,          NULL,         Prec_None},
   [Tk_Return] =         {NULL,          NULL,         Prec_None},
   [Tk_Let] =            {NULL,          NULL,         Prec_None},
+  [Tk_In] =             {NULL,          NULL,         Prec_None},
+  [Tk_Delete] =         {NULL,          NULL,         Prec_None},
 };
 
+// evaluates x op y at compile time. only does what the machine would do
+// without raising an error, anything else is left for runtime
+static bool fold_binary(Env* env, i32 op_kind, value x, value y, value* result) {
+  if(op_kind == Tk_Equal_Equal || op_kind == Tk_Bang_Equal) {
+    bool equal = check_equality(env, x, y);
+    *result = Value_Bool(op_kind == Tk_Equal_Equal ? equal : !equal);
+    return true;
+  }
+
+  if(op_kind == Tk_Plus && Object_isString(x) && Object_isString(y)) {
+    Object_String* a = Object_asString(x);
+    Object_String* b = Object_asString(y);
+    int len = a->len + b->len;
+    char* concat = ALLOCATE(char, len +1);
+    memcpy(concat, a->str, a->len);
+    memcpy(concat + a->len, b->str, b->len);
+    concat[len] = '\0';
+    *result = Value_Object(take_string(env, concat, len));
+    return true;
+  }
+
+  if(!Value_isNumber(x) || !Value_isNumber(y)) return false;
+  double a = Value_asNumber(x);
+  double b = Value_asNumber(y);
+  switch(op_kind) {
+    case Tk_Plus:          *result = Value_Number(a + b); return true;
+    case Tk_Minus:         *result = Value_Number(a - b); return true;
+    case Tk_Star:          *result = Value_Number(a * b); return true;
+    case Tk_Slash:         *result = Value_Number(a / b); return true;
+    case Tk_Less:          *result = Value_Bool(a < b); return true;
+    case Tk_Greater:       *result = Value_Bool(a > b); return true;
+    case Tk_Less_Equal:    *result = Value_Bool(!(a > b)); return true;
+    case Tk_Greater_Equal: *result = Value_Bool(!(a < b)); return true;
+    default: return false;
+  }
+}
+
 static void parse_binary(Env* env, bool assignable) {
   (void)assignable;
   i32 op_kind = parser.previous.kind;
+
+  // remember the left operand if it is a literal, parsing the right one
+  // overwrites last_known
+  Known_Value lhs = last_known;
+  bool lhs_known = lhs.start != -1 && lhs.end == env->stream.count;
   parse_expr(env, rules[op_kind].rbp);
 
+  value rhs, result;
+  if(lhs_known && known_from(env, lhs.end, &rhs) &&
+    fold_binary(env, op_kind, lhs.val, rhs, &result)) {
+    env->stream.count = lhs.start;
+    drop_constants(env, lhs.pool);
+    emit_known(env, result);
+    return;
+  }
+
   switch(op_kind) {
     case Tk_Plus:         emit_1byte(env, Op_Add); break;
     case Tk_Minus:        emit_1byte(env, Op_Sub); break;
@@ -372,10 +718,6 @@ static void parse_binary(Env* env, bool assignable) {
     case Tk_Less:         emit_1byte(env, Op_Less); break;
     case Tk_Greater:      emit_1byte(env, Op_Greater); break;
     case Tk_Equal_Equal:  emit_1byte(env, Op_Equal); break;
-    case Tk_Left_SqrParen: {
-      consume_token(Tk_Right_SqrParen, "Missing ']' after indexing expression");
-      emit_1byte(env, Op_List_Subscript);
-    } break;
     case Tk_Less_Equal:
       emit_1byte(env, Op_Greater);
       emit_1byte(env, Op_Not);
@@ -452,7 +794,9 @@ static void parse_while_stmt(Env* env) {
 }
 
 static void end_scope(Env* env);
-static void parse_var_decl(Env* env);
+static i32 parse_variable(Env* env, char* error_descr);
+static void parse_var_decl_rest(Env* env, i32 first_id);
+static void parse_for_in(Env* env);
 static void parse_for_stmt(Env* env) {
   locals_info.scope_depth += 1;
 
@@ -460,8 +804,13 @@ static void parse_for_stmt(Env* env) {
   if(match_token(Tk_Semicolon)) {
 
   }
-  if(match_token(Tk_Let)) {
-    parse_var_decl(env);
+  else if(match_token(Tk_Let)) {
+    i32 first_id = parse_variable(env, "Expect variable name");
+    if(match_token(Tk_In)) {
+      parse_for_in(env);
+      return;
+    }
+    parse_var_decl_rest(env, first_id);
   }
   else {
     parse_expr_stmt(env);
@@ -478,20 +827,29 @@ static void parse_for_stmt(Env* env) {
     emit_1byte(env, Op_Pop);
   }
 
-  // update
+  // update. it is written before the body but runs after it, so its code is
+  // cut out of the stream here and put back behind the body. this saves the
+  // two jumps around the body on every iteration. jumps inside an expression
+  // are relative to themselves and stay valid after the move
+  byte* inc_code = NULL;
+  i32 inc_len = 0;
   if(!check_token(Tk_Left_Brace)) {
-    i32 body_jump = emit_jump(env, Op_Jump);
     i32 inc_start = env->stream.count;
 
     parse_expr(env, Prec_Assign);
     emit_1byte(env, Op_Pop);
 
-    emit_loop(env, loop_start);
-    loop_start = inc_start;
-    patch_jump(env, body_jump);
+    inc_len = env->stream.count - inc_start;
+    inc_code = ALLOCATE(byte, inc_len);
+    memcpy(inc_code, env->stream.data + inc_start, inc_len);
+    env->stream.count = inc_start;
+    last_known.start = -1;
   }
 
   parse_stmt(env);
+  for(i32 x = 0; x < inc_len; x+=1)
+    emit_1byte(env, inc_code[x]);
+  FREE(inc_code);
   emit_loop(env, loop_start);
 
   if(exit_jump != -1) {
@@ -501,6 +859,40 @@ static void parse_for_stmt(Env* env) {
   end_scope(env);
 }
 
+static void add_local(Token name);
+static void mark_var_initialized(i32 idx);
+
+// locals only the compiler knows about, no identifier is empty
+static void add_hidden_local(void) {
+  Token name = {Tk_Identifier, "", 0};
+  add_local(name);
+  mark_var_initialized(locals_info.count -1);
+}
+
+// for let key in dict { }, the key was just declared. the dictionary and the
+// next slot to look at are two hidden locals right above the key, see
+// Op_Dict_Next
+static void parse_for_in(Env* env) {
+  i32 key_local = locals_info.count -1;
+  emit_1byte(env, Op_Null);
+  parse_expr(env, Prec_Assign);
+  mark_var_initialized(key_local);
+  add_hidden_local();
+  emit_constant(env, Value_Number(0));
+  add_hidden_local();
+
+  i32 loop_start = env->stream.count;
+  emit_2bytes(env, Op_Dict_Next, key_local);
+  i32 exit_jump = emit_jump(env, Op_Jump_If_False);
+  emit_1byte(env, Op_Pop);
+  parse_stmt(env);
+  emit_loop(env, loop_start);
+
+  patch_jump(env, exit_jump);
+  emit_1byte(env, Op_Pop);
+  end_scope(env);
+}
+
 static void parse_decl(Env* env);
 static void parse_block(Env* env) {
   while(!check_token(Tk_Right_Brace) && !check_token(Tk_Eof)) {
@@ -519,10 +911,41 @@ static void end_scope(Env* env) {
   }
 }
 
+static void parse_return_stmt(Env* env) {
+  if(!locals_info.in_proc)
+    error("Can't return from outside a procedure");
+
+  if(match_token(Tk_Semicolon))
+    emit_1byte(env, Op_Null);
+  else {
+    parse_expr(env, Prec_Assign);
+    consume_token(Tk_Semicolon, "Expect ';' after return value");
+  }
+  emit_1byte(env, Op_Return);
+}
+
+// delete dict[key]; the indexing is compiled as a read and its
+// Op_List_Subscript is turned into Op_Dict_Delete
+static void parse_delete_stmt(Env* env) {
+  last_subscript_end = -1;
+  parse_expr(env, Prec_Call);
+  if(last_subscript_end != env->stream.count)
+    error("Expect an indexing expression after delete");
+  else
+    env->stream.data[env->stream.count -1] = Op_Dict_Delete;
+  consume_token(Tk_Semicolon, "Expect ';' after delete");
+}
+
 static void parse_stmt(Env* env) {
   if(match_token(Tk_Print)) {
     parse_print_stmt(env);
   }
+  else if(match_token(Tk_Delete)) {
+    parse_delete_stmt(env);
+  }
+  else if(match_token(Tk_Return)) {
+    parse_return_stmt(env);
+  }
   else if(match_token(Tk_If)) {
     parse_if_stmt(env);
   }
@@ -571,57 +994,121 @@ static void declare_variable(void) {
   add_local(*name);
 }
 
-static uint8_t parse_variable(Env* env, char* error_descr) {
+static i32 parse_variable(Env* env, char* error_descr) {
   consume_token(Tk_Identifier, error_descr);
 
   declare_variable();
   if(locals_info.scope_depth > 0) return 0;
 
-  return identifier_constant(env, &parser.previous);
+  return identifier_slot(env, &parser.previous);
 }
 
-static void mark_var_initialized(uint8_t idx) {
+static void mark_var_initialized(i32 idx) {
   locals_info.locals[idx].active_on = locals_info.scope_depth;
 }
 
-static void define_variable(Env* env, uint8_t idx, uint32_t local_idx) {
+static void define_variable(Env* env, i32 slot, i32 local_idx) {
   if(locals_info.scope_depth > 0) {
     mark_var_initialized(local_idx);
     return;
   }
-  emit_2bytes(env, Op_Define_Global, idx);
+  emit_variable_op(env, Op_Define_Global_Slot, slot);
 }
 
-static void parse_var_decl(Env* env) {
-  uint8_t count = 0, ids[4];
-  ids[count] = parse_variable(env, "Expect variable name");
+// the first name was already parsed, its slot is first_id
+static void parse_var_decl_rest(Env* env, i32 first_id) {
+  i32 count = 0, ids[4];
+  ids[count] = first_id;
   count += 1;
   while(match_token(Tk_Comma)) {
+    if(count == 4) {
+      error("Too many variables in one declaration");
+      break;
+    }
     ids[count] = parse_variable(env, "Expect variable name");
     count += 1;
   }
 
-  uint8_t x = 0;
+  // locals of this declaration are the last ones added
+  i32 first_local = locals_info.count - count;
+  i32 x = 0;
   if(match_token(Tk_Equal)) {
     parse_expr(env, Prec_Assign);
-    define_variable(env, ids[x], x);
+    define_variable(env, ids[x], first_local + x);
     x += 1;
 
-    while(match_token(Tk_Comma)) {
+    while(x < count && match_token(Tk_Comma)) {
       parse_expr(env, Prec_Assign);
-      define_variable(env, ids[x], x);
+      define_variable(env, ids[x], first_local + x);
       x += 1;
     }
   }
-  else
+  // variables without an initializer start out as null
+  for(; x < count; x+=1) {
     emit_1byte(env, Op_Null);
+    define_variable(env, ids[x], first_local + x);
+  }
   consume_token(Tk_Semicolon, "Expect ';' after expression");
 }
 
+static void parse_var_decl(Env* env) {
+  parse_var_decl_rest(env, parse_variable(env, "Expect variable name"));
+}
+
+// procedures are globals and can't see the locals around them, so they are
+// only declared at the top level. the body is emitted into env->stream like
+// any other code, with the script's code and locals put aside meanwhile, and
+// then moved into the function object
+static void parse_proc_decl(Env* env) {
+  if(locals_info.scope_depth > 0 || locals_info.in_proc)
+    error("Procedures can only be declared at the top level");
+  i32 slot = parse_variable(env, "Expect procedure name");
+
+  // the constant keeps the function alive while its body is compiled
+  Object_Function* fn = make_function(env);
+  make_constant(env, Value_Object(fn));
+  fn->name = Object_asString(env->global_names.data[slot]);
+  gc_write_barrier(env, (Object*)fn, Value_Object(fn->name));
+
+  Locals_Info enclosing_locals = locals_info;
+  byte_vector enclosing_stream = env->stream;
+  byte_vector_allocate(&env->stream);
+  locals_info.count = 0;
+  locals_info.scope_depth = 1;
+  locals_info.in_proc = true;
+  last_known.start = -1;
+
+  consume_token(Tk_Left_Paren, "Expect '(' after procedure name");
+  if(!check_token(Tk_Right_Paren)) {
+    do {
+      parse_variable(env, "Expect parameter name");
+      mark_var_initialized(locals_info.count -1);
+      fn->arity += 1;
+    } while(match_token(Tk_Comma));
+  }
+  consume_token(Tk_Right_Paren, "Expect ')' after parameters");
+  consume_token(Tk_Left_Brace, "Expect '{' before procedure body");
+  parse_block(env);
+  emit_1byte(env, Op_Null);
+  emit_1byte(env, Op_Return);
+
+  byte_vector_deallocate(&fn->code);
+  fn->code = env->stream;
+  env->stream = enclosing_stream;
+  locals_info = enclosing_locals;
+  last_known.start = -1;
+
+  emit_constant(env, Value_Object(fn));
+  define_variable(env, slot, 0);
+}
+
 static void parse_decl(Env* env) {
   if(match_token(Tk_Let)) {
     parse_var_decl(env);
   }
+  else if(match_token(Tk_Proc)) {
+    parse_proc_decl(env);
+  }
   else {
     parse_stmt(env);
   }
@@ -638,11 +1125,15 @@ bool parse_and_gen_bytecode(Env* env, char* src) {
   parser.panic_mode = false;
   locals_info.count = 0;
   locals_info.scope_depth = 0;
+  locals_info.in_proc = false;
+  last_known.start = -1;
+  constant_index_allocate();
 
   while(!match_token(Tk_Eof))
     parse_decl(env);
 
   consume_token(Tk_Eof, "Expected end of expression");
   emit_1byte(env, Op_Return);
+  constant_index_deallocate();
   return !parser.had_error;
 }
@@ -1,24 +1,88 @@
 #include "table.h"
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
 
-// I will try to make this as understandable as possible.
-// I struggle with open_addressing a lot
+// Open addressing in the style of SwissTable. Next to the entries there is
+// one control byte per slot: Ctrl_Empty, Ctrl_Deleted or, for a slot in use,
+// the low 7 bits of the key's hash. Slots are looked at in groups of
+// Group_Width, the control bytes of a whole group are compared against the
+// tag at once (one SSE2 compare when available) and only entries whose tag
+// matches are touched. the probe sequence jumps from group to group
+// (triangular, it reaches every group since their number is a power of 2)
+// and stops at the first group that still has an empty slot.
+//
+// a deleted slot only needs a tombstone if its group is full, otherwise no
+// probe ever went past that group and the slot can simply become empty
+// again. tombstones count against the load factor and are dropped when the
+// table is rebuilt, at the same capacity if there aren't many live entries.
 
-// number of entries / number of buckets
-#define Table_Load_Factor 0.75
+#define Group_Width  16
+#define Ctrl_Empty   0x80
+#define Ctrl_Deleted 0xFE
 
-void table_allocate(Table* table) {
-  table->entries = ALLOCATE(Entry, 8);
-  table->count = 0;
-  table->cap = 8;
+// number of entries + tombstones / number of slots, 7/8
+#define Table_Max_Load(cap) ((cap) - (cap) / 8)
 
-  for(int x = 0; x < table->cap; x+=1) {
-    table->entries[x].key = NULL;
+#define Hash_Tag(hash)   ((uint8_t)((hash) & 0x7F))
+#define Hash_Group(hash) ((hash) >> 7)
+
+// bit x is set if control byte x of the group equals tag, the same for
+// Ctrl_Empty in *empty
+static inline uint32_t group_match(uint8_t* ctrl, uint8_t tag, uint32_t* empty) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((__m128i*)ctrl);
+  // _mm_set1_epi8 turns into 16 separate byte stores without optimization
+  __m128i tags = _mm_shuffle_epi32(_mm_cvtsi32_si128(tag * 0x01010101u), 0);
+  __m128i empties = _mm_shuffle_epi32(_mm_cvtsi32_si128(0x80808080u), 0);
+  *empty = _mm_movemask_epi8(_mm_cmpeq_epi8(group, empties));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, tags));
+#else
+  uint32_t mask = 0;
+  *empty = 0;
+  for(int x = 0; x < Group_Width; x+=1) {
+    mask |= (uint32_t)(ctrl[x] == tag) << x;
+    *empty |= (uint32_t)(ctrl[x] == Ctrl_Empty) << x;
+  }
+  return mask;
+#endif
+}
+
+// empty and deleted are the only control bytes with the high bit set
+static inline uint32_t group_match_free(uint8_t* ctrl) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((__m128i*)ctrl));
+#else
+  uint32_t mask = 0;
+  for(int x = 0; x < Group_Width; x+=1)
+    mask |= (uint32_t)(ctrl[x] >> 7) << x;
+  return mask;
+#endif
+}
+
+#define Next_Bit(mask) (__builtin_ctz(mask))
+
+static void table_init(Table* table, int cap) {
+  table->entries = ALLOCATE(Entry, cap);
+  table->ctrl = ALLOCATE(uint8_t, cap);
+  table->cap = cap;
+  table->count = 0;
+  table->used = 0;
+  memset(table->ctrl, Ctrl_Empty, cap);
+  for(int x = 0; x < cap; x+=1) {
+    table->entries[x].key = Value_Null();
     table->entries[x].val = Value_Null();
   }
 }
+
+void table_allocate(Table* table) {
+  table_init(table, Group_Width);
+}
 void table_deallocate(Table* table) {
   FREE(table->entries);
+  FREE(table->ctrl);
   table->count = 0;
+  table->used = 0;
   table->cap = 0;
 }
 
@@ -31,136 +95,254 @@ uint32_t fnv_1a(char* bytes, int len) {
   return hash;
 }
 
-Object_String* table_find_string(Table* table, char* str, int len, uint32_t hash) {
-  if(table->count == 0) return NULL;
-  uint32_t idx = hash % table->cap;
-  for(;;) {
-    Entry* entry = &table->entries[idx];
-
-    if(entry->key == NULL) {
-      // check if its tombstone. if it isn't then no such entry exists
-      if(Value_isNull(entry->val))
-        return NULL;
-    }
-    // memcmp is at the last because its slowest part.. also the last test
-    // early bail out if hash/length are not the same
-    // memcmp's failure means hash collision occured
-    else if(entry->key->len == len &&
-      entry->key->hash == hash &&
-      memcmp(entry->key->str, str, len) == 0)
-      return entry->key;
-
-    idx = (idx +1) % table->cap;
+// 64x64 -> 128 bit multiply folded back to 64 bits, mixes every input bit
+// into every output bit. without 128 bit integers a 64 bit multiply and
+// xorshift stands in, which hashes differently so images don't carry over
+static inline uint64_t fold_multiply(uint64_t x, uint64_t y) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)x * y;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t r = x * (y | 1);
+  return r ^ (r >> 32);
+#endif
+}
+
+// eats 16 bytes per round in two independent 8 byte lanes where fnv_1a
+// does a multiply per byte. SSE2 has no wide enough multiply to do better
+// with vectors, plain 64 bit words it is
+uint32_t hash_words(char* bytes, int len) {
+  uint64_t a = 0x9E3779B97F4A7C15ull ^ (uint64_t)len;
+  uint64_t b = 0xC2B2AE3D27D4EB4Full;
+  int x = 0;
+  for(; x + 16 <= len; x+=16) {
+    uint64_t w0, w1;
+    memcpy(&w0, bytes + x, 8);
+    memcpy(&w1, bytes + x +8, 8);
+    a = fold_multiply(a ^ w0, 0xA0761D6478BD642Full);
+    b = fold_multiply(b ^ w1, 0xE7037ED1A0B428DBull);
   }
+
+  uint64_t tail[2] = {0, 0};
+  memcpy(tail, bytes + x, len - x);
+  a = fold_multiply(a ^ tail[0], 0xA0761D6478BD642Full);
+  b = fold_multiply(b ^ tail[1], 0xE7037ED1A0B428DBull);
+
+  uint64_t hash = fold_multiply(a ^ 0x8EBC6AF09C88C6E3ull, b ^ (uint64_t)len);
+  return (uint32_t)(hash ^ (hash >> 32));
 }
 
-Entry* table_find_entry(Entry* entries, int cap, Object_String* key) {
-  // wraps the idx around table->caps
-  uint32_t idx = key->hash % cap;
-  Entry* tombstone = NULL;
-
-  // this infinite for loop assumes that will stop after finding a empty entry
-  // or actual entry
-  // and this is true because table is never full..
-  for(;;) {
-    Entry* entry = &entries[idx];
-
-    // checking for tombstone
-    if(entry->key == NULL) {
-      // empty bucket. either return old tombstone if present or this new found
-      // empty entry
-      if(Value_isNull(entry->val))
-        return tombstone != NULL ? tombstone : entry;
-      else
-        // tombstone found keep that in check for later use
-        if(tombstone == NULL)
-          tombstone = entry;
-    }
-    // return the key as normal
-    else if(entry->key == key)
-      return entry;
+// identifiers are short, fnv_1a is as fast as anything there
+uint32_t hash_mixed(char* bytes, int len) {
+  if(len < Hash_Short_Len) return fnv_1a(bytes, len);
+  return hash_words(bytes, len);
+}
 
-    // collision occured do linear probing
-    idx = (idx +1) % cap;
+// strings bring their hash along, everything else is hashed by its bits.
+// -0 and 0 are the same key so they have to hash the same
+static uint32_t key_hash(value key) {
+  if(Object_isString(key)) return Object_asString(key)->hash;
+  uint64_t bits;
+  if(Value_isNumber(key)) {
+    double num = Value_asNumber(key) + 0.0;
+    memcpy(&bits, &num, sizeof(bits));
   }
+  else if(Value_isObject(key)) bits = (uintptr_t)Value_asObject(key);
+  else if(Value_isBool(key)) bits = Value_asBool(key) ? 1 : 2;
+  else bits = 3;
+  uint64_t hash = fold_multiply(bits ^ 0x9E3779B97F4A7C15ull, 0xA0761D6478BD642Full);
+  return (uint32_t)(hash ^ (hash >> 32));
 }
 
-void adjust_table_cap(Table* table, int new_cap) {
-  Entry* entries = ALLOCATE(Entry, new_cap);
+// objects, interned strings among them, are the same key only if they are
+// the same object
+static inline bool keys_equal(value x, value y) {
+  if(Value_isObject(x))
+    return Value_isObject(y) && Value_asObject(x) == Value_asObject(y);
+  if(Value_isNumber(x))
+    return Value_isNumber(y) && Value_asNumber(x) == Value_asNumber(y);
+  if(Value_isBool(x))
+    return Value_isBool(y) && Value_asBool(x) == Value_asBool(y);
+  return Value_isNull(x) && Value_isNull(y);
+}
 
-  // initialize the table with null values
-  for(int x = 0; x < new_cap; x+=1) {
-    entries[x].key = NULL;
-    entries[x].val = Value_Null();
+// slot of key, -1 if it isn't in the table
+static int find_slot(Table* table, value key) {
+  uint32_t hash = key_hash(key);
+  uint32_t group_mask = table->cap / Group_Width -1;
+  uint32_t group = Hash_Group(hash) & group_mask;
+  uint8_t tag = Hash_Tag(hash);
+
+  for(uint32_t step = 1;; step+=1) {
+    uint32_t empty;
+    uint32_t mask = group_match(table->ctrl + group * Group_Width, tag, &empty);
+    for(; mask != 0; mask &= mask -1) {
+      int idx = group * Group_Width + Next_Bit(mask);
+      if(keys_equal(table->entries[idx].key, key)) return idx;
+    }
+    if(empty != 0) return -1;
+    group = (group + step) & group_mask;
   }
+}
 
-  // need to rehash the complete table again because of hash % table->cap
-  // will change.
-  // so try finding bucket for old keys and assign it new buckets of the new
-  // entries
-  table->count = 0;
-  for(int x = 0; x < table->cap; x+=1) {
-    Entry* entry = &table->entries[x];
+// first empty or deleted slot on the probe sequence of hash
+static int find_free_slot(Table* table, uint32_t hash) {
+  uint32_t group_mask = table->cap / Group_Width -1;
+  uint32_t group = Hash_Group(hash) & group_mask;
+
+  for(uint32_t step = 1;; step+=1) {
+    uint32_t mask = group_match_free(table->ctrl + group * Group_Width);
+    if(mask != 0) return group * Group_Width + Next_Bit(mask);
+    group = (group + step) & group_mask;
+  }
+}
+
+Object_String* table_find_string(Table* table, char* str, int len, uint32_t hash) {
+  if(table->count == 0) return NULL;
+  uint32_t group_mask = table->cap / Group_Width -1;
+  uint32_t group = Hash_Group(hash) & group_mask;
+  uint8_t tag = Hash_Tag(hash);
+
+  for(uint32_t step = 1;; step+=1) {
+    uint32_t empty;
+    uint32_t mask = group_match(table->ctrl + group * Group_Width, tag, &empty);
+    for(; mask != 0; mask &= mask -1) {
+      value entry_key = table->entries[group * Group_Width + Next_Bit(mask)].key;
+      if(!Object_isString(entry_key)) continue;
+      Object_String* key = Object_asString(entry_key);
+      // memcmp is at the last because its slowest part
+      if(key->len == len && key->hash == hash &&
+        memcmp(key->str, str, len) == 0)
+        return key;
+    }
+    if(empty != 0) return NULL;
+    group = (group + step) & group_mask;
+  }
+}
 
-    // don't check for tombstones.. they will be discarded..
-    if(entry->key == NULL) continue;
+// rebuilds the table with new_cap slots, tombstones are left behind
+static void adjust_table_cap(Table* table, int new_cap) {
+  Entry* old_entries = table->entries;
+  uint8_t* old_ctrl = table->ctrl;
+  int old_cap = table->cap;
 
-    Entry* dst = table_find_entry(entries, new_cap, entry->key);
-    dst->key = entry->key;
-    dst->val = entry->val;
+  table_init(table, new_cap);
+  for(int x = 0; x < old_cap; x+=1) {
+    if(old_ctrl[x] & 0x80) continue;
+    uint32_t hash = key_hash(old_entries[x].key);
+    int idx = find_free_slot(table, hash);
+    table->ctrl[idx] = Hash_Tag(hash);
+    table->entries[idx] = old_entries[x];
     table->count += 1;
+    table->used += 1;
   }
 
-  FREE(table->entries);
-  table->entries = entries;
-  table->cap = new_cap;
+  FREE(old_entries);
+  FREE(old_ctrl);
 }
 
-bool table_set(Table* table, Object_String* key, value val) {
+bool table_set(Table* table, value key, value val) {
+  int idx = find_slot(table, key);
+  if(idx != -1) {
+    table->entries[idx].val = val;
+    return false;
+  }
 
-  // if table cap can't accomodate the entries allocate more!
-  if(table->count +1 > table->cap * Table_Load_Factor) {
-    int new_cap = table->cap * 2;
+  if(table->used +1 > Table_Max_Load(table->cap)) {
+    // mostly tombstones, rebuilding at the same size is enough
+    int new_cap = table->count +1 > Table_Max_Load(table->cap) / 2 ?
+      table->cap * 2 : table->cap;
     adjust_table_cap(table, new_cap);
   }
-  // check if it already there or not
-  Entry* entry = table_find_entry(table->entries, table->cap, key); 
-  bool is_new_key = entry->key == NULL;
 
-  // so it new one.. increase the count (tombstone are not counted)
-  if(is_new_key && Value_isNull(entry->val))
-    table->count +=1;
+  uint32_t hash = key_hash(key);
+  idx = find_free_slot(table, hash);
+  if(table->ctrl[idx] == Ctrl_Empty)
+    table->used += 1;
+  table->ctrl[idx] = Hash_Tag(hash);
+  table->entries[idx].key = key;
+  table->entries[idx].val = val;
+  table->count += 1;
+  return true;
+}
 
-  entry->key = key;
-  entry->val = val;
+bool table_get(Table* table, value key, value* val) {
+  if(table->count == 0) return false;
 
-  // it returns true if its a new one is inserted
-  return is_new_key;
+  int idx = find_slot(table, key);
+  if(idx == -1) return false;
+  *val = table->entries[idx].val;
+  return true;
 }
 
-bool table_get(Table* table, Object_String* key, value* val) {
-  // Duh!
-  if(table->count == 0) return false;
+// same as table_get but hands out the slot itself
+Entry* table_get_entry(Table* table, value key) {
+  if(table->count == 0) return NULL;
 
-  // pretty much self explanatory
-  Entry* entry = table_find_entry(table->entries, table->cap, key);
-  if(entry->key == NULL) return false;
+  int idx = find_slot(table, key);
+  if(idx == -1) return NULL;
+  return &table->entries[idx];
+}
 
-  *val = entry->val;
-  return true;
+static void erase_slot(Table* table, int idx) {
+  uint32_t empty;
+  group_match(table->ctrl + (idx & ~(Group_Width -1)), Ctrl_Empty, &empty);
+  if(empty != 0) {
+    table->ctrl[idx] = Ctrl_Empty;
+    table->used -= 1;
+  }
+  else table->ctrl[idx] = Ctrl_Deleted;
+
+  table->entries[idx].key = Value_Null();
+  table->entries[idx].val = Value_Null();
+  table->count -= 1;
 }
 
-bool table_delete(Table* table, Object_String* key) {
+bool table_delete(Table* table, value key) {
   if(table->count == 0) return false;
 
-  Entry* entry = table_find_entry(table->entries, table->cap, key);
-  if(entry->key == NULL) return false;
-
-  // set a sentinel value to represent Tombstone
-  // tombstone is entry that is grave of deleted entry
-  // it is placed so that probe sequence don't break if deleted entry
-  // was part of them
-  entry->key = NULL;
-  entry->val = Value_Bool(true);
+  int idx = find_slot(table, key);
+  if(idx == -1) return false;
+  erase_slot(table, idx);
   return true;
 }
+
+// first slot in use at idx or after it, -1 if there is none. walks the
+// entries in slot order, which is all the order a table has
+int table_next(Table* table, int idx) {
+  for(; idx < table->cap; idx+=1)
+    if(!(table->ctrl[idx] & 0x80)) return idx;
+  return -1;
+}
+
+// drops every entry whose key the collector didn't reach, only looking at
+// keys of the generation being collected. used on the interned strings
+// which shouldn't keep strings alive by themselves
+void table_remove_unmarked(Table* table, bool young) {
+  for(int x = 0; x < table->cap; x+=1) {
+    if(table->ctrl[x] & 0x80) continue;
+    Object* key = Value_asObject(table->entries[x].key);
+    if(!key->is_marked && key->is_old != young)
+      erase_slot(table, x);
+  }
+}
+
+// number of groups looked at until key was found, 0 if it isn't there.
+// for tools/hash_bench.c
+int table_probe_count(Table* table, value key) {
+  if(table->count == 0) return 0;
+  uint32_t hash = key_hash(key);
+  uint32_t group_mask = table->cap / Group_Width -1;
+  uint32_t group = Hash_Group(hash) & group_mask;
+  uint8_t tag = Hash_Tag(hash);
+
+  for(uint32_t step = 1;; step+=1) {
+    uint32_t empty;
+    uint32_t mask = group_match(table->ctrl + group * Group_Width, tag, &empty);
+    for(; mask != 0; mask &= mask -1)
+      if(keys_equal(table->entries[group * Group_Width + Next_Bit(mask)].key, key))
+        return step;
+    if(empty != 0) return 0;
+    group = (group + step) & group_mask;
+  }
+}
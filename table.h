@@ -2,20 +2,56 @@
 #include "common.h"
 #include "object.h"
 
+// any value can be a key. strings are compared by pointer so they have to
+// be interned, numbers by value and other objects by identity
 typedef struct {
-  Object_String* key;
+  value key;
   value val;
 } Entry;
 
+// see table.c for the layout. cap is a power of 2 and at least 16
 typedef struct {
   Entry* entries;
-  int count, cap;
+  uint8_t* ctrl;
+  int count;  // live entries
+  int used;   // live entries and tombstones
+  int cap;
 } Table;
 
 void table_allocate(Table* table);
 void table_deallocate(Table* table);
-bool table_get(Table* table, Object_String* key, value* val);
+bool table_get(Table* table, value key, value* val);
+Entry* table_get_entry(Table* table, value key);
 Object_String* table_find_string(Table* table, char* str, int len, uint32_t hash);
-bool table_set(Table* table, Object_String* key, value val);
-bool table_delete(Table* table, Object_String* key);
+bool table_set(Table* table, value key, value val);
+bool table_delete(Table* table, value key);
+int table_next(Table* table, int idx);
+void table_remove_unmarked(Table* table, bool young);
+int table_probe_count(Table* table, value key);
+
+// Dictionaries are a Table in an object. keys are null, bools, numbers
+// other than NaN and strings, see dict_key() for how they get there
+typedef struct {
+  Object object;
+  Table table;
+} Object_Dict;
+#define Object_asDict(val)    ((Object_Dict*)Value_asObject(val))
+#define Object_isDict(val)    (object_istype(val, Ok_Dict))
+
+Object_Dict* allocate_dict(Env* env);
+void dict_set(Env* env, Object_Dict* dict, value key, value val);
+
+// every string hash in the machine goes through String_Hash, build with
+// -DString_Hash=fnv_1a (or any other Hash_Function) to swap it out.
+// hash_mixed uses fnv_1a for strings shorter than Hash_Short_Len and
+// hash_words for the rest
+typedef uint32_t (*Hash_Function)(char* bytes, int len);
 uint32_t fnv_1a(char* bytes, int len);
+uint32_t hash_words(char* bytes, int len);
+uint32_t hash_mixed(char* bytes, int len);
+#ifndef String_Hash
+  #define String_Hash hash_mixed
+#endif
+#ifndef Hash_Short_Len
+  #define Hash_Short_Len 16
+#endif
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Runs every tests/*.ch and compares what it prints with its "# expect: "
+# comments, in order. "# expect error: msg" wants msg somewhere on stderr
+# and a failing exit status instead. Scripts that should run cleanly are
+# also compiled to an image and run again from it. The disassembly ./play
+# prints before running is skipped.
+#
+#   tests/run.sh [path to play]
+play=${1:-./play}
+tmp=$(mktemp -d)
+failed=0
+
+# what the program printed, everything after the last disassembly and the
+# blank line that closes it
+program_output() {
+  awk '/^=== End ===$/ { n = NR +1 } { line[NR] = $0 }
+    END { for(x = n +1; x <= NR; x+=1) print line[x] }' "$1"
+}
+
+check() {
+  test=$1; how=$2; shift 2
+  "$play" "$@" >"$tmp/out" 2>"$tmp/err"
+  status=$?
+  if [ -n "$error" ]; then
+    if [ $status -eq 0 ] || ! grep -qF -- "$error" "$tmp/err"; then
+      echo "FAIL $test ($how): expected error '$error', exit status $status"
+      sed 's/^/  /' "$tmp/err"
+      failed=1
+    fi
+    return
+  fi
+  program_output "$tmp/out" >"$tmp/actual"
+  if [ $status -ne 0 ] || ! cmp -s "$tmp/expected" "$tmp/actual"; then
+    echo "FAIL $test ($how): exit status $status"
+    diff -u "$tmp/expected" "$tmp/actual" | tail -n +3 | sed 's/^/  /'
+    sed 's/^/  /' "$tmp/err"
+    failed=1
+  fi
+}
+
+for test in tests/*.ch; do
+  sed -n 's/^.*# expect: //p' "$test" >"$tmp/expected"
+  error=$(sed -n 's/^.*# expect error: //p' "$test")
+  check "$test" script "$test"
+  [ -n "$error" ] && continue
+  if "$play" --compile "$tmp/image.chc" "$test" >/dev/null 2>"$tmp/err"; then
+    check "$test" image "$tmp/image.chc"
+  else
+    echo "FAIL $test (image): --compile failed"
+    sed 's/^/  /' "$tmp/err"
+    failed=1
+  fi
+done
+
+rm -rf "$tmp"
+[ $failed -eq 0 ] && echo "all tests passed"
+exit $failed
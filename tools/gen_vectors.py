@@ -1,4 +1,4 @@
-types = ['byte', 'value']
+types = ['byte', 'value', 'double']
 
 h = open("vectors.h", "w")
 c = open("vectors.c", "w")
@@ -16,6 +16,7 @@ i32 count, cap;
 } %(ty)s_vector;
 void %(ty)s_vector_allocate(%(ty)s_vector* vec);
 void %(ty)s_vector_pushback(%(ty)s_vector* vec, %(ty)s val);
+void %(ty)s_vector_reserve(%(ty)s_vector* vec, i32 cap);
 void %(ty)s_vector_deallocate(%(ty)s_vector* vec);
 %(ty)s %(ty)s_vector_pop(%(ty)s_vector* vec);
 void %(ty)s_reset(%(ty)s_vector* vec);
@@ -43,6 +44,13 @@ void %(ty)s_vector_pushback(%(ty)s_vector* vec, %(ty)s val) {
   vec->data[vec->count] = val;
   vec->count += 1;
 }
+// grows the buffer to exactly cap elements if it is smaller, for callers
+// that know the final size up front
+void %(ty)s_vector_reserve(%(ty)s_vector* vec, i32 cap) {
+  if(vec->cap >= cap) return;
+  vec->cap = cap;
+  vec->data = REALLOCATE(%(ty)s, vec->data, vec->cap);
+}
 %(ty)s %(ty)s_vector_pop(%(ty)s_vector* vec) {
   if(vec->count == 0) {
     fprintf(stderr, "Pop on an empty vector(%(ty)s). Aborting\n");
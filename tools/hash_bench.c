@@ -0,0 +1,194 @@
+// Compares the string hash functions from table.c on the kind of strings
+// the machine hashes: identifiers and literals pulled out of the scripts
+// given on the command line, generated identifiers, and runtime strings of
+// a few lengths. prints throughput and the probe length distribution of a
+// Table filled with each key set.
+//
+//   make hash_bench && ./hash_bench bench/*.ch tests/*.ch
+
+#include <stdio.h>
+#include <time.h>
+#include <ctype.h>
+#include "../table.h"
+
+typedef struct {
+  const char* name;
+  Hash_Function fn;
+} Hash_Candidate;
+
+static Hash_Candidate candidates[] = {
+  {"fnv_1a", fnv_1a},
+  {"hash_words", hash_words},
+  {"hash_mixed", hash_mixed},
+};
+#define Candidate_Count ((int)(sizeof(candidates) / sizeof(candidates[0])))
+
+typedef struct {
+  const char* name;
+  Object_String* keys;
+  int count, cap;
+} Key_Set;
+
+static void key_set_add(Key_Set* set, char* str, int len) {
+  if(set->cap < set->count +1) {
+    set->cap = set->cap < 64 ? 64 : set->cap * 2;
+    set->keys = REALLOCATE(Object_String, set->keys, set->cap);
+  }
+  Object_String* key = &set->keys[set->count];
+  key->object.kind = Ok_String;
+  key->str = ALLOCATE(char, len +1);
+  memcpy(key->str, str, len);
+  key->str[len] = '\0';
+  key->len = len;
+  set->count += 1;
+}
+
+static void key_set_free(Key_Set* set) {
+  for(int x = 0; x < set->count; x+=1)
+    FREE(set->keys[x].str);
+  FREE(set->keys);
+}
+
+// identifiers and string literals of a script, duplicates are fine, the
+// machine hashes every occurrence
+static void add_script(Key_Set* idents, Key_Set* literals, char* file_name) {
+  FILE* fptr = fopen(file_name, "r");
+  if(fptr == NULL) {
+    fprintf(stderr, "ERROR: %s: can't open\n", file_name);
+    return;
+  }
+  char line[4096];
+  while(fgets(line, sizeof(line), fptr) != NULL) {
+    for(char* c = line; *c != '\0';) {
+      if(*c == '#') break;
+      if(*c == '"') {
+        char* end = strchr(c +1, '"');
+        if(end == NULL) break;
+        key_set_add(literals, c +1, end - c -1);
+        c = end +1;
+      }
+      else if(isalpha((unsigned char)*c) || *c == '_') {
+        char* start = c;
+        while(isalnum((unsigned char)*c) || *c == '_') c += 1;
+        key_set_add(idents, start, c - start);
+      }
+      else c += 1;
+    }
+  }
+  fclose(fptr);
+}
+
+static void add_generated_idents(Key_Set* set, int count) {
+  static const char* stems[] = {"i", "x", "count", "total_", "player", "idx",
+    "left_node", "result_value"};
+  char buf[64];
+  for(int x = 0; x < count; x+=1) {
+    int len = snprintf(buf, sizeof(buf), "%s%i", stems[x % 8], x / 8);
+    key_set_add(set, buf, len);
+  }
+}
+
+// what concatenation produces: long runs of the same few pieces
+static void add_runtime_strings(Key_Set* set, int count, int len) {
+  static const char* pieces[] = {"abc", "hello ", "0123456789", ", ", "xyz"};
+  char* buf = ALLOCATE(char, len +1);
+  for(int x = 0; x < count; x+=1) {
+    int at = snprintf(buf, len +1, "%i:", x);
+    for(int p = x; at < len; p = p * 7 +3) {
+      const char* piece = pieces[(unsigned)p % 5];
+      for(int y = 0; piece[y] != '\0' && at < len; y+=1)
+        buf[at++] = piece[y];
+    }
+    key_set_add(set, buf, len);
+  }
+  FREE(buf);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_throughput(Key_Set* set, Hash_Candidate* candidate) {
+  size_t bytes = 0;
+  for(int x = 0; x < set->count; x+=1)
+    bytes += set->keys[x].len;
+
+  // repeat until it runs long enough to time
+  int rounds = 1 + (int)(50000000 / (bytes + set->count * 8));
+  volatile uint32_t sink = 0;
+  double start = now();
+  for(int r = 0; r < rounds; r+=1)
+    for(int x = 0; x < set->count; x+=1)
+      sink ^= candidate->fn(set->keys[x].str, set->keys[x].len);
+  double secs = now() - start;
+  (void)sink;
+
+  printf("  %-12s %10.1f MB/s %8.1f ns/key\n", candidate->name,
+    bytes * (double)rounds / secs / 1e6,
+    secs * 1e9 / ((double)rounds * set->count));
+}
+
+// distinct keys only, the table is keyed by pointer so duplicates would
+// each get their own entry
+static void bench_probes(Key_Set* set, Hash_Candidate* candidate) {
+  Table table;
+  table_allocate(&table);
+  for(int x = 0; x < set->count; x+=1) {
+    Object_String* key = &set->keys[x];
+    key->hash = candidate->fn(key->str, key->len);
+    table_set(&table, Value_Object(key), Value_Null());
+  }
+
+  int histogram[5] = {0};   // 1, 2, 3-4, 5-8, 9+
+  long total = 0;
+  int max = 0;
+  for(int x = 0; x < set->count; x+=1) {
+    int probes = table_probe_count(&table, Value_Object(&set->keys[x]));
+    total += probes;
+    if(probes > max) max = probes;
+    int bucket = probes <= 1 ? 0 : probes == 2 ? 1 : probes <= 4 ? 2 :
+      probes <= 8 ? 3 : 4;
+    histogram[bucket] += 1;
+  }
+  printf("  %-12s avg %5.2f max %4i | 1:%6i 2:%6i 3-4:%6i 5-8:%6i 9+:%6i\n",
+    candidate->name, (double)total / set->count, max, histogram[0],
+    histogram[1], histogram[2], histogram[3], histogram[4]);
+  table_deallocate(&table);
+}
+
+int main(int argc, char** argv) {
+  Key_Set idents = {"script identifiers", NULL, 0, 0};
+  Key_Set literals = {"script literals", NULL, 0, 0};
+  for(int x = 1; x < argc; x+=1)
+    add_script(&idents, &literals, argv[x]);
+
+  Key_Set generated = {"generated identifiers", NULL, 0, 0};
+  add_generated_idents(&generated, 50000);
+  Key_Set medium = {"runtime strings, 48 bytes", NULL, 0, 0};
+  add_runtime_strings(&medium, 20000, 48);
+  Key_Set longer = {"runtime strings, 1k", NULL, 0, 0};
+  add_runtime_strings(&longer, 2000, 1024);
+
+  Key_Set* sets[] = {&idents, &literals, &generated, &medium, &longer};
+  printf("=== Throughput ===\n");
+  for(int s = 0; s < 5; s+=1) {
+    if(sets[s]->count == 0) continue;
+    printf("%s (%i keys)\n", sets[s]->name, sets[s]->count);
+    for(int c = 0; c < Candidate_Count; c+=1)
+      bench_throughput(sets[s], &candidates[c]);
+  }
+
+  printf("\n=== Probe lengths (groups of 16 slots) ===\n");
+  Key_Set* distinct[] = {&generated, &medium, &longer};
+  for(int s = 0; s < 3; s+=1) {
+    printf("%s (%i keys)\n", distinct[s]->name, distinct[s]->count);
+    for(int c = 0; c < Candidate_Count; c+=1)
+      bench_probes(distinct[s], &candidates[c]);
+  }
+
+  for(int s = 0; s < 5; s+=1)
+    key_set_free(sets[s]);
+  return 0;
+}
@@ -4,6 +4,63 @@
 typedef struct Object Object;
 typedef struct Object_String Object_String;
 typedef struct Object_List Object_List;
+#ifdef NAN_BOXING
+// Every value is a single 64-bit word. Numbers are stored as plain doubles,
+// anything else lives inside the payload of a quiet NaN that the FPU never
+// produces by itself. Objects additionally set the sign bit and keep their
+// pointer (48 bits on every target we care about) in the low bits.
+//
+//   number  : any double whose bits are not a Quiet_Nan
+//   null    : Quiet_Nan | Tag_Null
+//   false   : Quiet_Nan | Tag_False
+//   true    : Quiet_Nan | Tag_True
+//   undef   : Quiet_Nan | Tag_Undefined (never visible to scripts)
+//   object  : Sign_Bit | Quiet_Nan | pointer
+typedef uint64_t value;
+
+#define Sign_Bit  ((uint64_t)0x8000000000000000)
+#define Quiet_Nan ((uint64_t)0x7ffc000000000000)
+
+#define Tag_Null  1
+#define Tag_False 2
+#define Tag_True  3
+#define Tag_Undefined 4
+
+#define Null_Val  ((value)(Quiet_Nan | Tag_Null))
+#define False_Val ((value)(Quiet_Nan | Tag_False))
+#define True_Val  ((value)(Quiet_Nan | Tag_True))
+#define Undefined_Val ((value)(Quiet_Nan | Tag_Undefined))
+
+static inline double value_to_number(value val) {
+  double num;
+  memcpy(&num, &val, sizeof(double));
+  return num;
+}
+static inline value number_to_value(double num) {
+  value val;
+  memcpy(&val, &num, sizeof(double));
+  return val;
+}
+
+#define Value_asBool(val)   ((val) == True_Val)
+#define Value_asNumber(val) value_to_number(val)
+#define Value_asObject(val) ((Object*)(uintptr_t)((val) & ~(Sign_Bit | Quiet_Nan)))
+
+#define Value_Bool(val)   ((val) ? True_Val : False_Val)
+#define Value_Number(val) number_to_value(val)
+#define Value_Null()      Null_Val
+#define Value_Undefined() Undefined_Val
+#define Value_Object(val) ((value)(Sign_Bit | Quiet_Nan | (uint64_t)(uintptr_t)(val)))
+
+#define Value_isBool(val)   (((val) | 1) == True_Val)
+#define Value_isNumber(val) (((val) & Quiet_Nan) != Quiet_Nan)
+#define Value_isNull(val)   ((val) == Null_Val)
+#define Value_isUndefined(val) ((val) == Undefined_Val)
+#define Value_isObject(val) \
+  (((val) & (Sign_Bit | Quiet_Nan)) == (Sign_Bit | Quiet_Nan))
+
+#else
+
 typedef enum {
   Vk_Error,
   Vk_Bool,
@@ -28,9 +85,13 @@ typedef struct {
 #define Value_Bool(val)   ((value){.kind=Vk_Bool, .boolean=val})
 #define Value_Number(val) ((value){.kind=Vk_Number, .number=val})
 #define Value_Null()      ((value){.kind=Vk_Null, .number=0})
+#define Value_Undefined() ((value){.kind=Vk_Error, .number=0})
 #define Value_Object(val) ((value){.kind=Vk_Object, .object=(Object*)val})
 
 #define Value_isBool(val)   (val.kind == Vk_Bool)
 #define Value_isNumber(val) (val.kind == Vk_Number)
 #define Value_isNull(val)   (val.kind == Vk_Null)
+#define Value_isUndefined(val) (val.kind == Vk_Error)
 #define Value_isObject(val) (val.kind == Vk_Object)
+
+#endif
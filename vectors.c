@@ -22,6 +22,13 @@ void byte_vector_pushback(byte_vector* vec, byte val) {
   vec->data[vec->count] = val;
   vec->count += 1;
 }
+// grows the buffer to exactly cap elements if it is smaller, for callers
+// that know the final size up front
+void byte_vector_reserve(byte_vector* vec, i32 cap) {
+  if(vec->cap >= cap) return;
+  vec->cap = cap;
+  vec->data = REALLOCATE(byte, vec->data, vec->cap);
+}
 byte byte_vector_pop(byte_vector* vec) {
   if(vec->count == 0) {
     fprintf(stderr, "Pop on an empty vector(byte). Aborting\n");
@@ -52,6 +59,13 @@ void value_vector_pushback(value_vector* vec, value val) {
   vec->data[vec->count] = val;
   vec->count += 1;
 }
+// grows the buffer to exactly cap elements if it is smaller, for callers
+// that know the final size up front
+void value_vector_reserve(value_vector* vec, i32 cap) {
+  if(vec->cap >= cap) return;
+  vec->cap = cap;
+  vec->data = REALLOCATE(value, vec->data, vec->cap);
+}
 value value_vector_pop(value_vector* vec) {
   if(vec->count == 0) {
     fprintf(stderr, "Pop on an empty vector(value). Aborting\n");
@@ -60,3 +74,40 @@ value value_vector_pop(value_vector* vec) {
   vec->count -= 1;
   return vec->data[vec->count];
 }
+
+void double_vector_allocate(double_vector* vec) {
+  vec->data = ALLOCATE(double, 8);
+  vec->count = 0;
+  vec->cap = 8;
+}
+void double_vector_deallocate(double_vector* vec) {
+  FREE(vec->data);
+  vec->count = 0;
+  vec->cap = 0;
+}
+void double_reset(double_vector* vec) {
+  vec->count = 0;
+}
+void double_vector_pushback(double_vector* vec, double val) {
+  if(vec->cap < vec->count +1) {
+    vec->cap *= 2;
+    vec->data = REALLOCATE(double, vec->data, vec->cap);
+  }
+  vec->data[vec->count] = val;
+  vec->count += 1;
+}
+// grows the buffer to exactly cap elements if it is smaller, for callers
+// that know the final size up front
+void double_vector_reserve(double_vector* vec, i32 cap) {
+  if(vec->cap >= cap) return;
+  vec->cap = cap;
+  vec->data = REALLOCATE(double, vec->data, vec->cap);
+}
+double double_vector_pop(double_vector* vec) {
+  if(vec->count == 0) {
+    fprintf(stderr, "Pop on an empty vector(double). Aborting\n");
+    exit(1);
+  }
+  vec->count -= 1;
+  return vec->data[vec->count];
+}
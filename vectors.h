@@ -8,6 +8,7 @@ i32 count, cap;
 } byte_vector;
 void byte_vector_allocate(byte_vector* vec);
 void byte_vector_pushback(byte_vector* vec, byte val);
+void byte_vector_reserve(byte_vector* vec, i32 cap);
 void byte_vector_deallocate(byte_vector* vec);
 byte byte_vector_pop(byte_vector* vec);
 void byte_reset(byte_vector* vec);
@@ -18,6 +19,18 @@ i32 count, cap;
 } value_vector;
 void value_vector_allocate(value_vector* vec);
 void value_vector_pushback(value_vector* vec, value val);
+void value_vector_reserve(value_vector* vec, i32 cap);
 void value_vector_deallocate(value_vector* vec);
 value value_vector_pop(value_vector* vec);
 void value_reset(value_vector* vec);
+
+typedef struct {
+double* data;
+i32 count, cap;
+} double_vector;
+void double_vector_allocate(double_vector* vec);
+void double_vector_pushback(double_vector* vec, double val);
+void double_vector_reserve(double_vector* vec, i32 cap);
+void double_vector_deallocate(double_vector* vec);
+double double_vector_pop(double_vector* vec);
+void double_reset(double_vector* vec);